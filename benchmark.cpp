@@ -0,0 +1,395 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFileInfo>
+#include <QtCore/QTemporaryDir>
+
+#include "homm3map.h"
+#include "homm3singleton.h"
+#include "load_statistics.h"
+#include "synthetic_data.h"
+
+namespace {
+
+// every allocation through global operator new is counted, so that loads can be compared by count of allocations too,
+// aligned variants are replaced as well, because default memory resource of std::pmr allocates through them
+std::atomic<int64_t> allocations_count { 0 };
+std::atomic<int64_t> allocations_size { 0 };
+
+} // unnamed namespace
+
+void* operator new(size_t size)
+{
+	++allocations_count;
+	allocations_size += size;
+
+	void *result = malloc((size > 0) ? size : 1);
+	if (result == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return result;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	++allocations_count;
+	allocations_size += size;
+
+	// size passed to aligned_alloc must be multiple of alignment
+	const size_t align = std::max(static_cast<size_t>(alignment), sizeof(void*));
+	void *result = aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align);
+	if (result == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return result;
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+namespace {
+
+struct AllocationCount
+{
+	int64_t count = 0;
+	int64_t size = 0;
+};
+
+struct BenchmarkOptions
+{
+	int iterations = 5;
+	int warmup = 1;
+	bool csv = false;
+};
+
+double toMilliseconds(int64_t value_ns)
+{
+	return static_cast<double>(value_ns) / 1000000.0;
+}
+
+template <typename T>
+T getMedian(std::vector<T> values)
+{
+	if (values.empty())
+	{
+		return T();
+	}
+
+	std::sort(values.begin(), values.end());
+
+	return values[values.size() / 2];
+}
+
+template <typename T>
+std::vector<int64_t> collectValues(const std::vector<std::shared_ptr<MapData> > &results, T get_value_func)
+{
+	std::vector<int64_t> values;
+
+	values.reserve(results.size());
+
+	for (const auto &result: results)
+	{
+		values.push_back(get_value_func(result->m_statistics));
+	}
+
+	return values;
+}
+
+std::shared_ptr<MapData> loadMap(Homm3MapLoader &loader, const QString &map_name, int level, AllocationCount &allocations)
+{
+	std::shared_ptr<MapData> result;
+
+	const int64_t first_count = allocations_count;
+	const int64_t first_size = allocations_size;
+
+	auto connection = QObject::connect(&loader, &Homm3MapLoader::mapLoaded, [&result](std::shared_ptr<MapData> data) {
+		result = data;
+	});
+
+	loader.loadMapData(map_name, std::shared_ptr<CMap>(), level);
+
+	allocations.count = allocations_count - first_count;
+	allocations.size = allocations_size - first_size;
+
+	QObject::disconnect(connection);
+
+	return result;
+}
+
+void printResults(const QString &map_name, int level, const std::vector<std::shared_ptr<MapData> > &results, const std::vector<AllocationCount> &allocations, const BenchmarkOptions &options)
+{
+	const auto &last_result = results.back();
+	const QByteArray name = QFileInfo(map_name).fileName().toUtf8();
+
+	if (!options.csv)
+	{
+		printf("map %s level %d (%dx%d)\n", name.constData(), level, last_result->m_map->width, last_result->m_map->height);
+		printf("  %-14s %12s %12s %12s %14s %8s\n", "stage", "median_ms", "min_ms", "max_ms", "rss_delta_kib", "calls");
+	}
+
+	// textures are uploaded by renderer, so there is nothing to measure for it here
+	for (int stage = 0; stage < static_cast<int>(LoadStage::gl_upload); ++stage)
+	{
+		auto times = collectValues(results, [stage](const LoadStatistics &statistics) { return statistics.getStage(static_cast<LoadStage>(stage)).elapsed_ns; });
+		auto rss_deltas = collectValues(results, [stage](const LoadStatistics &statistics) { return statistics.getStage(static_cast<LoadStage>(stage)).rss_delta; });
+		const char *stage_name = LoadStatistics::getStageName(static_cast<LoadStage>(stage));
+		size_t calls = last_result->m_statistics.getStage(static_cast<LoadStage>(stage)).calls;
+
+		if (options.csv)
+		{
+			printf("%s,%d,%s.median_ms,%.3f\n", name.constData(), level, stage_name, toMilliseconds(getMedian(times)));
+			printf("%s,%d,%s.min_ms,%.3f\n", name.constData(), level, stage_name, toMilliseconds(*std::min_element(times.begin(), times.end())));
+			printf("%s,%d,%s.max_ms,%.3f\n", name.constData(), level, stage_name, toMilliseconds(*std::max_element(times.begin(), times.end())));
+			printf("%s,%d,%s.rss_delta_kib,%lld\n", name.constData(), level, stage_name, static_cast<long long>(getMedian(rss_deltas) / 1024));
+			printf("%s,%d,%s.calls,%zu\n", name.constData(), level, stage_name, calls);
+		}
+		else
+		{
+			printf("  %-14s %12.3f %12.3f %12.3f %14lld %8zu\n",
+				stage_name,
+				toMilliseconds(getMedian(times)),
+				toMilliseconds(*std::min_element(times.begin(), times.end())),
+				toMilliseconds(*std::max_element(times.begin(), times.end())),
+				static_cast<long long>(getMedian(rss_deltas) / 1024),
+				calls);
+		}
+	}
+
+	auto total_times = collectValues(results, [](const LoadStatistics &statistics) { return statistics.getTotalTime(); });
+	int64_t total_time = std::max<int64_t>(getMedian(total_times), 1);
+	double tiles_per_second = static_cast<double>(last_result->m_map->width) * last_result->m_map->height * 1000000000.0 / total_time;
+	double mib_per_second = static_cast<double>(last_result->m_statistics.getCounter("map_file_size")) * 1000000000.0 / total_time / (1024.0 * 1024.0);
+
+	// peak of whole process would include earlier loads and data archives, so growth of resident memory during stages of this load is shown instead
+	auto load_rss_deltas = collectValues(results, [](const LoadStatistics &statistics) {
+		int64_t rss_delta = 0;
+
+		for (int stage = 0; stage < static_cast<int>(LoadStage::gl_upload); ++stage)
+		{
+			rss_delta += statistics.getStage(static_cast<LoadStage>(stage)).rss_delta;
+		}
+
+		return rss_delta;
+	});
+
+	long long load_rss_delta_kib = static_cast<long long>(getMedian(load_rss_deltas) / 1024);
+
+	std::vector<int64_t> allocation_counts;
+	std::vector<int64_t> allocation_sizes;
+
+	for (const auto &allocation: allocations)
+	{
+		allocation_counts.push_back(allocation.count);
+		allocation_sizes.push_back(allocation.size);
+	}
+
+	if (options.csv)
+	{
+		printf("%s,%d,total.median_ms,%.3f\n", name.constData(), level, toMilliseconds(total_time));
+		printf("%s,%d,throughput.tiles_per_s,%.0f\n", name.constData(), level, tiles_per_second);
+		printf("%s,%d,throughput.map_mib_per_s,%.3f\n", name.constData(), level, mib_per_second);
+		printf("%s,%d,total.rss_delta_kib,%lld\n", name.constData(), level, load_rss_delta_kib);
+		printf("%s,%d,allocations.median_count,%lld\n", name.constData(), level, static_cast<long long>(getMedian(allocation_counts)));
+		printf("%s,%d,allocations.median_kib,%lld\n", name.constData(), level, static_cast<long long>(getMedian(allocation_sizes) / 1024));
+	}
+	else
+	{
+		printf("  %-14s %12.3f %12s %12s %14lld\n", "total", toMilliseconds(total_time), "", "", load_rss_delta_kib);
+		printf("  throughput: %.0f tiles/s, %.3f MiB/s of map data\n", tiles_per_second, mib_per_second);
+		printf("  allocations: %lld, %lld KiB\n", static_cast<long long>(getMedian(allocation_counts)), static_cast<long long>(getMedian(allocation_sizes) / 1024));
+	}
+
+	// counters don't depend on timing, they should be same between runs on same data
+	QVariantMap counters = last_result->m_statistics.toVariantMap().value(QStringLiteral("counters")).toMap();
+
+	for (auto iter = counters.constBegin(); iter != counters.constEnd(); ++iter)
+	{
+		if (options.csv)
+		{
+			printf("%s,%d,%s,%lld\n", name.constData(), level, iter.key().toUtf8().constData(), iter.value().toLongLong());
+		}
+		else
+		{
+			printf("  %-32s %16lld\n", iter.key().toUtf8().constData(), iter.value().toLongLong());
+		}
+	}
+
+	if (!options.csv)
+	{
+		printf("\n");
+	}
+}
+
+bool benchmarkMap(Homm3MapLoader &loader, const QString &map_name, const BenchmarkOptions &options)
+{
+	int levels = 1;
+
+	for (int level = 0; level < levels; ++level)
+	{
+		std::vector<std::shared_ptr<MapData> > results;
+		std::vector<AllocationCount> allocations;
+
+		for (int iteration = 0; iteration < options.warmup + options.iterations; ++iteration)
+		{
+			AllocationCount iteration_allocations;
+			auto result = loadMap(loader, map_name, level, iteration_allocations);
+
+			if ((!result) || (!result->m_map))
+			{
+				fprintf(stderr, "Failed to load map %s\n", map_name.toLocal8Bit().constData());
+				return false;
+			}
+
+			levels = result->m_map->twoLevel ? 2 : 1;
+
+			if (iteration >= options.warmup)
+			{
+				results.push_back(result);
+				allocations.push_back(iteration_allocations);
+			}
+		}
+
+		printResults(map_name, level, results, allocations, options);
+	}
+
+	return true;
+}
+
+} // unnamed namespace
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		QCoreApplication app(argc, argv);
+		QCoreApplication::setApplicationName(QStringLiteral("homm3map-bench"));
+
+		QCommandLineParser parser;
+		parser.setApplicationDescription(QStringLiteral("Measures loading of HOMM3 maps without rendering them"));
+		parser.addHelpOption();
+		parser.addPositionalArgument(QStringLiteral("maps"), QStringLiteral("Map files to load, generated maps are used if none are specified"), QStringLiteral("[maps...]"));
+
+		QCommandLineOption archive_option(QStringList { QStringLiteral("a"), QStringLiteral("archive") }, QStringLiteral("Game data archive, may be specified multiple times"), QStringLiteral("file"));
+		QCommandLineOption generate_option(QStringList { QStringLiteral("g"), QStringLiteral("generate") }, QStringLiteral("Write synthetic archive and maps into directory and keep them"), QStringLiteral("directory"));
+		QCommandLineOption seed_option(QStringList { QStringLiteral("s"), QStringLiteral("seed") }, QStringLiteral("Seed for synthetic data"), QStringLiteral("seed"), QStringLiteral("1"));
+		QCommandLineOption iterations_option(QStringList { QStringLiteral("n"), QStringLiteral("iterations") }, QStringLiteral("Measured loads per map level"), QStringLiteral("count"), QStringLiteral("5"));
+		QCommandLineOption warmup_option(QStringList { QStringLiteral("w"), QStringLiteral("warmup") }, QStringLiteral("Loads per map level which are not measured"), QStringLiteral("count"), QStringLiteral("1"));
+		QCommandLineOption csv_option(QStringLiteral("csv"), QStringLiteral("Print results as comma-separated map, level, metric and value"));
+
+		parser.addOption(archive_option);
+		parser.addOption(generate_option);
+		parser.addOption(seed_option);
+		parser.addOption(iterations_option);
+		parser.addOption(warmup_option);
+		parser.addOption(csv_option);
+
+		parser.process(app);
+
+		BenchmarkOptions options;
+		options.iterations = std::max(parser.value(iterations_option).toInt(), 1);
+		options.warmup = std::max(parser.value(warmup_option).toInt(), 0);
+		options.csv = parser.isSet(csv_option);
+
+		QStringList archives = parser.values(archive_option);
+		QStringList maps = parser.positionalArguments();
+
+		QTemporaryDir temporary_dir;
+
+		// use generated data if either archives or maps are not specified
+		if (parser.isSet(generate_option) || archives.isEmpty() || maps.isEmpty())
+		{
+			QString directory = parser.isSet(generate_option) ? parser.value(generate_option) : temporary_dir.path();
+
+			if (directory.isEmpty())
+			{
+				throw std::runtime_error("Failed to create temporary directory");
+			}
+
+			SyntheticData synthetic_data = generate_synthetic_data(directory.toLocal8Bit().constData(), parser.value(seed_option).toUInt());
+
+			if (archives.isEmpty())
+			{
+				archives.append(QString::fromLocal8Bit(synthetic_data.archive.c_str()));
+			}
+
+			if (maps.isEmpty())
+			{
+				for (const auto &map: synthetic_data.maps)
+				{
+					maps.append(QString::fromLocal8Bit(map.c_str()));
+				}
+			}
+		}
+
+		Homm3MapSingleton::getInstance()->setDataArchives(archives);
+
+		if (Homm3MapSingleton::getInstance()->getDataArchives()->lod_entries.empty())
+		{
+			throw std::runtime_error("No images found in data archives");
+		}
+
+		if (options.csv)
+		{
+			printf("map,level,metric,value\n");
+		}
+		else
+		{
+			printf("iterations: %d, warmup: %d\n\n", options.iterations, options.warmup);
+		}
+
+		// nothing is rendered, so pages are packed for usual limit of OpenGL implementations
+		Homm3MapLoader loader(Homm3MapSingleton::getInstance()->getDataArchives(), Homm3MapSingleton::default_max_texture_size);
+		bool success = true;
+
+		for (const auto &map: maps)
+		{
+			success = benchmarkMap(loader, QFileInfo(map).absoluteFilePath(), options) && success;
+		}
+
+		return success ? 0 : 1;
+	}
+	catch (const std::exception &e)
+	{
+		printf("Caught exception: %s\n", e.what());
+	}
+
+	return -1;
+}
@@ -30,7 +30,7 @@ struct DefGroupHelperData
 
 } // unnamed namespace
 
-Def read_def_file(const std::string &lod_filename, const LodEntry &lod_entry, int player_color)
+Def read_def_file(const std::string &lod_filename, const LodEntry &lod_entry, int player_color, bool header_only)
 {
 	Def result;
 
@@ -134,6 +134,11 @@ Def read_def_file(const std::string &lod_filename, const LodEntry &lod_entry, in
 				frame.y      = reader.readUInt32();
 			}
 
+			if (header_only)
+			{
+				continue;
+			}
+
 			auto dataOffset = data_stream->tell();
 
 			switch (compression)
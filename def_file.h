@@ -10,4 +10,5 @@
 
 #include "globals.h"
 
-Def read_def_file(const std::string &lod_filename, const LodEntry &lod_entry, int player_color);
+// if header_only is set, only sizes and positions of frames are read, but not their data
+Def read_def_file(const std::string &lod_filename, const LodEntry &lod_entry, int player_color, bool header_only = false);
@@ -38,7 +38,9 @@ QImage Homm3ImageProvider::requestImage(const QString &id, QSize *size, const QS
 		return QImage();
 	}
 
-	const auto &lod_entries = Homm3MapSingleton::getInstance()->lod_entries;
+	// archives may be replaced while image is read
+	auto archives = Homm3MapSingleton::getInstance()->getDataArchives();
+	const auto &lod_entries = archives->lod_entries;
 
 	auto lod_entries_iter = lod_entries.find(id.toLocal8Bit().data());
 	if (lod_entries_iter == lod_entries.end())
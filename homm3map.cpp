@@ -9,21 +9,38 @@
 #include "homm3map.h"
 
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
 
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <filesystem>
 #include <iomanip>
 #include <limits>
+#include <iterator>
 #include <map>
+#include <memory_resource>
+#include <numeric>
+#include <optional>
+#include <set>
 #include <sstream>
+#include <string_view>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QEvent>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
 #include <QtCore/QMutexLocker>
+#include <QtCore/QSaveFile>
 #include <QtCore/QUrl>
+#include <QtGui/QOpenGLContext>
 #include <QtGui/QVector2D>
-#include <QtGui/QVector3D>
+#include <QtGui/QVector4D>
 #include <QtOpenGL/QOpenGLFramebufferObjectFormat>
 
 #include "vcmi/CCompressedStream.h"
@@ -56,19 +73,50 @@ const std::map<std::string, std::tuple<SpecialTile, int> > special_tiles_map = {
 	{ "lavrvr.def", { SpecialTile::lavrvr, 9 } },
 };
 
+// all frames of terrain, rivers and roads are placed into atlas whether map uses them or not,
+// so that their pages are same for every map and stay on GPU when map changes
+const char* const ground_def_names[] = {
+	"dirttl.def", "sandtl.def", "grastl.def", "snowtl.def", "swmptl.def", "rougtl.def", "subbtl.def", "lavatl.def", "watrtl.def", "rocktl.def",
+	"clrrvr.def", "icyrvr.def", "mudrvr.def", "lavrvr.def",
+	"dirtrd.def", "gravrd.def", "cobbrd.def",
+};
+
+// sprite and palette animation counter wraps when all animations restart, but it has to stay exact as float in shader
+const size_t max_animation_cycle = 1 << 24;
+
+// items are kept in containers of loader arena, their names are allocated from the same arena
 struct MapItem
 {
-	std::string name;
+	typedef std::pmr::polymorphic_allocator<char> allocator_type;
+
+	std::pmr::string name;
 	int group = 0;
 	int special = -1; // player color or ground frame
-	size_t total_frames = 1;
+	TextureHandle handle = TextureAtlas::invalid_handle;
 
-	MapItem() = default;
+	MapItem(std::string_view l_name, const allocator_type &allocator)
+		: name(l_name, allocator)
+	{
+	}
+
+	MapItem(const MapItem &other, const allocator_type &allocator)
+		: name(other.name, allocator)
+		, group(other.group)
+		, special(other.special)
+		, handle(other.handle)
+	{
+	}
 
-	explicit MapItem(const std::string &l_name)
-		: name(l_name)
+	MapItem(MapItem &&other, const allocator_type &allocator)
+		: name(std::move(other.name), allocator)
+		, group(other.group)
+		, special(other.special)
+		, handle(other.handle)
 	{
 	}
+
+	MapItem(const MapItem &other) = default;
+	MapItem(MapItem &&other) = default;
 };
 
 struct MapItemPosition
@@ -195,17 +243,17 @@ std::tuple<std::string, int, int> getRoadTile(const std::shared_ptr<CMap> &map,
 	return std::make_tuple(road_type_iter->second, tile.roadDir, (tile.extTileFlags >> 4) & 0x03);
 }
 
-Def loadDefFile(const std::string &name, int special)
+std::shared_ptr<const Def> loadDefFile(const DataArchives &archives, const std::string &name, int special, bool header_only = false)
 {
-	const auto &lod_entries = Homm3MapSingleton::getInstance()->lod_entries;
+	const auto &lod_entries = archives.lod_entries;
 
 	auto lod_entries_iter = lod_entries.find(name);
 	if (lod_entries_iter == lod_entries.end())
 	{
-		return Def();
+		return std::shared_ptr<const Def>();
 	}
 
-	Def image_def = read_def_file(std::get<0>(lod_entries_iter->second), std::get<1>(lod_entries_iter->second), special);
+	auto image_def = std::make_shared<Def>(read_def_file(std::get<0>(lod_entries_iter->second), std::get<1>(lod_entries_iter->second), special, header_only));
 
 	static const std::set<DefType> allowed_name_set =
 	{
@@ -221,25 +269,214 @@ Def loadDefFile(const std::string &name, int special)
 		DefType::battle_hero,
 	};
 
-	if ((image_def.groups.empty()) || (allowed_name_set.find(image_def.type) == allowed_name_set.end()))
+	if ((image_def->groups.empty()) || (allowed_name_set.find(image_def->type) == allowed_name_set.end()))
 	{
-		return Def();
+		return std::shared_ptr<const Def>();
 	}
 
 	return image_def;
 }
 
-} // unnamed namespace
+size_t getDefDataSize(const Def &image_def)
+{
+	size_t result = 0;
 
-#define frame_duration 180
+	for (auto group_iter = image_def.groups.begin(); group_iter != image_def.groups.end(); ++group_iter)
+	{
+		for (auto frame_iter = group_iter->frames.begin(); frame_iter != group_iter->frames.end(); ++frame_iter)
+		{
+			result += frame_iter->data.size();
+		}
+	}
+
+	return result;
+}
+
+QRect getFrameBounds(const DefFrame &frame)
+{
+	return QRect(frame.x, frame.y, frame.width, frame.height);
+}
+
+// palette row keeps colors of all palette indices of image, with transparency and palette animation already applied
+const size_t palette_row_size = 256 * 4;
+
+// rows of palette texture used by image, animated palette takes one row per frame
+struct PaletteRows
+{
+	size_t first = 0;
+	size_t count = 1;
+};
+
+// position of frame inside of part of image which is stored in atlas and offset of its data
+struct DecodedFrame
+{
+	int x = 0;
+	int y = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	size_t data_offset = 0;
+};
+
+// image which is composed into atlas once it's packed, identical images are kept only once
+struct DecodedImage
+{
+	explicit DecodedImage(std::pmr::memory_resource *resource)
+		: frames(resource)
+		, data(resource)
+	{
+	}
+
+	TextureHandle handle = TextureAtlas::invalid_handle;
+	QSize size;
+	std::pmr::vector<DecodedFrame> frames;
+	std::pmr::vector<uint8_t> data;
+};
+
+// palette is applied when drawing, so images are equal if all their frames have same palette indices, whatever palettes of images are
+uint64_t getImageHash(const QSize &size, const QPoint &offset, const std::pmr::vector<const DefFrame*> &frames)
+{
+	uint64_t result = 14695981039346656037ULL;
+
+	auto add_value_func = [&result](uint32_t value) {
+		for (int i = 0; i < 4; ++i)
+		{
+			result = (result ^ ((value >> (i * 8)) & 0xFF)) * 1099511628211ULL;
+		}
+	};
+
+	for (uint32_t value: { static_cast<uint32_t>(size.width()), static_cast<uint32_t>(size.height()), static_cast<uint32_t>(frames.size()) })
+	{
+		add_value_func(value);
+	}
+
+	for (const DefFrame *frame: frames)
+	{
+		for (uint32_t value: { static_cast<uint32_t>(frame->x - offset.x()), static_cast<uint32_t>(frame->y - offset.y()), frame->width, frame->height })
+		{
+			add_value_func(value);
+		}
+
+		for (size_t i = 0; i < static_cast<size_t>(frame->width) * frame->height; ++i)
+		{
+			result = (result ^ frame->data[i]) * 1099511628211ULL;
+		}
+	}
+
+	return result;
+}
+
+// pages are big, so they are hashed by 8 bytes at once
+uint64_t getPageHash(const QSize &size, const std::vector<uint8_t> &data)
+{
+	uint64_t result = 14695981039346656037ULL;
+
+	for (uint64_t value: { static_cast<uint64_t>(size.width()), static_cast<uint64_t>(size.height()) })
+	{
+		result = (result ^ value) * 1099511628211ULL;
+	}
+
+	size_t offset = 0;
+
+	for (; offset + sizeof(uint64_t) <= data.size(); offset += sizeof(uint64_t))
+	{
+		uint64_t value;
+		memcpy(&value, data.data() + offset, sizeof(value));
 
-bool AnimatedItem::operator<(const AnimatedItem &other) const
+		result = (result ^ value) * 1099511628211ULL;
+		result ^= result >> 29;
+	}
+
+	for (; offset < data.size(); ++offset)
+	{
+		result = (result ^ data[offset]) * 1099511628211ULL;
+	}
+
+	return result;
+}
+
+bool imagesAreEqual(const DecodedImage &decoded_image, const QSize &size, const QPoint &offset, const std::pmr::vector<const DefFrame*> &frames)
+{
+	if ((decoded_image.size != size) || (decoded_image.frames.size() != frames.size()))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		const auto &decoded_frame = decoded_image.frames[i];
+		const DefFrame &frame = *(frames[i]);
+
+		if ((decoded_frame.x != frame.x - offset.x()) || (decoded_frame.y != frame.y - offset.y()) || (decoded_frame.width != frame.width) || (decoded_frame.height != frame.height))
+		{
+			return false;
+		}
+
+		if (memcmp(decoded_image.data.data() + decoded_frame.data_offset, frame.data.data(), static_cast<size_t>(frame.width) * frame.height) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t addAnimationCycle(size_t cycle, size_t frames)
+{
+	return std::min(std::lcm(cycle, std::max<size_t>(frames, 1)), max_animation_cycle);
+}
+
+// map is split into square chunks of tiles, draw batches never cross chunks, so invisible chunks may be skipped
+const int chunk_tiles = 16;
+
+int getChunkCoordinate(int tile, int tiles_count)
+{
+	// borders of map belong to nearest chunk
+	return std::clamp(tile, 0, std::max(tiles_count - 1, 0)) / chunk_tiles;
+}
+
+// terrain, rivers and roads, each layer is one quad drawn over whole map
+const int ground_layers = 3;
+
+// each ground item takes one row of RGBA texels in items texture
+const int ground_item_texels = 3;
+
+QPoint getGroundLayerOrigin(int layer)
 {
-	return std::tie(this->name, this->group, this->special, this->total_frames, this->is_terrain) < std::tie(other.name, other.group, other.special, other.total_frames, other.is_terrain);
+	// roads are drawn half of tile lower than terrain and rivers
+	return QPoint(tile_size, (layer == 2) ? (tile_size + tile_size / 2) : tile_size);
 }
 
-Homm3MapLoader::Homm3MapLoader(QObject *parent)
+// after first frame only animated parts of map are redrawn, they are tracked in square cells of tiles
+const int animation_cell_tiles = 4;
+
+// two triangles of unit square, sprites and ground layers are made by moving and scaling it
+const std::array<QVector2D, 6> quad_corners = {
+	QVector2D(0, 0),
+	QVector2D(1, 0),
+	QVector2D(0, 1),
+	QVector2D(1, 0),
+	QVector2D(0, 1),
+	QVector2D(1, 1),
+};
+
+// pages of new map are uploaded in slices of rows which are not bigger than this
+const int upload_slice_size = 4 * 1024 * 1024;
+
+// without instancing sprite is repeated for every corner of its quad
+struct SpriteVertex
+{
+	SpriteInstance sprite;
+	float corner[2];
+};
+
+} // unnamed namespace
+
+#define frame_duration 180
+
+Homm3MapLoader::Homm3MapLoader(std::shared_ptr<const DataArchives> archives, int max_texture_size, QObject *parent)
 	: QObject(parent)
+	, m_archives(archives)
+	, m_max_texture_size(max_texture_size)
 {
 }
 
@@ -260,9 +497,19 @@ void Homm3MapLoader::loadMapData(QString map_name, std::shared_ptr<CMap> map, in
 
 			std::unique_ptr<CInputStream> data_stream(new CCompressedStream(std::unique_ptr<CFileInputStream>(new CFileInputStream(map_url.toLocalFile().toLocal8Bit().data())), true));
 
-			CMapLoaderH3M map_loader(data_stream.get());
+			{
+				// getting size of compressed stream decompresses it completely
+				LoadStageTimer stage_timer(result->m_statistics, LoadStage::inflate);
+				result->m_statistics.setCounter("map_file_size", data_stream->getSize());
+			}
+
+			{
+				LoadStageTimer stage_timer(result->m_statistics, LoadStage::parse);
+
+				CMapLoaderH3M map_loader(data_stream.get());
 
-			result->m_map = map_loader.loadMap();
+				result->m_map = map_loader.loadMap();
+			}
 		}
 		catch (...)
 		{
@@ -274,109 +521,137 @@ void Homm3MapLoader::loadMapData(QString map_name, std::shared_ptr<CMap> map, in
 	result->m_name = map_name;
 	result->m_level = std::min(std::max(level, 0), getMapLevels(result->m_map) - 1);
 
-	// first load all images
-	std::map<std::tuple<std::string, int>, Def> defs_map;
-	std::map<MapItemPosition, std::vector<MapItem> > map_objects;
+	// either requested level is prepared, or all levels of map one after another
+	const int first_level = (level == all_map_levels) ? 0 : result->m_level;
+	const int level_count = (level == all_map_levels) ? getMapLevels(result->m_map) : 1;
+
+	// all temporary data is allocated from one arena and released at once when loading is finished,
+	// arena never reuses memory, so buffers which grow in it are reserved with their final size
+	CountingMemoryResource loader_arena_upstream;
+	std::pmr::monotonic_buffer_resource loader_arena(&loader_arena_upstream);
+
+	// first load headers of all images, they are enough to place images into texture atlas
+	std::pmr::map<std::pmr::string, std::shared_ptr<const Def>, std::less<> > def_headers_map(&loader_arena);
+	std::pmr::vector<std::pmr::map<MapItemPosition, std::pmr::vector<MapItem> > > map_objects(level_count, &loader_arena);
+
+	// images of every tile are remembered while inserting them, so that drawing doesn't need to look them up
+	std::pmr::vector<TextureHandle> edge_images(36, TextureAtlas::invalid_handle, &loader_arena);
+	std::pmr::vector<TextureHandle> terrain_images(getMapWidth(result->m_map) * getMapHeight(result->m_map) * level_count, TextureAtlas::invalid_handle, &loader_arena);
+	std::pmr::vector<TextureHandle> river_images(terrain_images.size(), TextureAtlas::invalid_handle, &loader_arena);
+	std::pmr::vector<TextureHandle> road_images(terrain_images.size(), TextureAtlas::invalid_handle, &loader_arena);
+
+	std::pmr::vector<int> top_edge(&loader_arena);
+	std::pmr::vector<int> right_edge(&loader_arena);
+	std::pmr::vector<int> bottom_edge(&loader_arena);
+	std::pmr::vector<int> left_edge(&loader_arena);
+
+	// headers are shared between all users, missing files are remembered too
+	auto load_def_header_func = [this, &def_headers_map, &result](std::string_view name) -> std::shared_ptr<const Def> {
+		auto def_iter = def_headers_map.find(name);
+		if (def_iter == def_headers_map.end())
+		{
+			LoadStageTimer stage_timer(result->m_statistics, LoadStage::def_resolve);
+
+			def_iter = def_headers_map.emplace(name, loadDefFile(*m_archives, std::string(name), -1, true)).first;
+		}
 
-	QVector<int> top_edge, right_edge, bottom_edge, left_edge;
+		return def_iter->second;
+	};
 
-	auto load_def_file_func = [&defs_map](const std::string &name, int special) -> Def {
-		auto def_iter = defs_map.find(std::make_tuple(name, special));
-		if (def_iter == defs_map.end())
+	// water, lava and rivers are animated by palette when drawing, so every tile is a single image
+	auto insert_tile_func = [&result](const std::string &name, int frame, const std::shared_ptr<const Def> &def_header) -> TextureHandle {
+		if ((!def_header) || (def_header->groups.size() == 0) || (def_header->groups[0].frames.size() <= frame))
 		{
-			Def def_result = loadDefFile(name, special);
+			return TextureAtlas::invalid_handle;
+		}
 
-			if (def_result.type != DefType::unknown)
-			{
-				defs_map[std::make_tuple(name, special)] = def_result;
-			}
+		return result->m_texture_atlas.insertItem(TextureItem(name, 0, frame, -1), QSize(def_header->fullWidth, def_header->fullHeight), getFrameBounds(def_header->groups[0].frames[frame]));
+	};
 
-			return def_result;
+	// all frames of animated image are kept in one atlas item,
+	// bounds are same for all frames so that animation doesn't have to move vertices
+	auto insert_object_func = [&result](MapItem &map_item, const std::shared_ptr<const Def> &def_header) {
+		if ((!def_header) || (def_header->groups.size() <= map_item.group) || (def_header->groups[map_item.group].frames.size() == 0))
+		{
+			return;
 		}
-		else
+
+		const auto &frames = def_header->groups[map_item.group].frames;
+
+		QRect bounds;
+
+		for (const auto &frame: frames)
 		{
-			return def_iter->second;
+			bounds = bounds.united(getFrameBounds(frame));
 		}
+
+		map_item.handle = result->m_texture_atlas.insertItem(TextureItem(std::string(map_item.name), map_item.group, 0, map_item.special), QSize(def_header->fullWidth, def_header->fullHeight), bounds, frames.size());
+		result->m_animation_cycle = addAnimationCycle(result->m_animation_cycle, frames.size());
 	};
 
-	size_t total_squares = 4 + 2 * getMapWidth(result->m_map) + 2 * getMapHeight(result->m_map);
+	size_t total_squares = (4 + 2 * getMapWidth(result->m_map) + 2 * getMapHeight(result->m_map)) * level_count;
+
+	std::optional<LoadStageTimer> stage_timer;
+	stage_timer.emplace(result->m_statistics, LoadStage::atlas_pack);
 
 	// load edges
 	{
-		Def def_file = load_def_file_func("edg.def", -1);
+		auto def_header = load_def_header_func("edg.def");
 
-		if ((def_file.type != DefType::unknown) && (def_file.groups.size() > 0))
+		if (def_header && (def_header->groups.size() > 0))
 		{
 			for (int i = 16; i < 36; ++i)
 			{
-				if (def_file.groups[0].frames.size() > i)
+				if (def_header->groups[0].frames.size() > i)
 				{
-					result->m_texture_atlas.insertItem(TextureItem("edg.def", 0, i, -1), QSize(def_file.fullWidth, def_file.fullHeight));
+					edge_images[i] = result->m_texture_atlas.insertItem(TextureItem("edg.def", 0, i, -1), QSize(def_header->fullWidth, def_header->fullHeight), getFrameBounds(def_header->groups[0].frames[i]));
 				}
 			}
 		}
 	}
 
-	if (result->m_map)
+	for (const char *def_name: ground_def_names)
 	{
-		// load terrain, rivers and roads
-		for (int tile_y = 0; tile_y < getMapHeight(result->m_map); ++tile_y)
+		auto def_header = load_def_header_func(def_name);
+
+		if (def_header && (def_header->groups.size() > 0))
 		{
-			for (int tile_x = 0; tile_x < getMapWidth(result->m_map); ++tile_x)
+			for (int frame = 0; frame < def_header->groups[0].frames.size(); ++frame)
 			{
-				auto tile_info = getTerrainTile(result->m_map, tile_x, tile_y, result->m_level);
+				insert_tile_func(def_name, frame, def_header);
+			}
+		}
+	}
 
-				++total_squares;
-				Def def_file = load_def_file_func(std::get<0>(tile_info), -1);
+	result->m_texture_atlas.finishCommonItems();
 
-				if ((def_file.type != DefType::unknown) && (def_file.groups.size() > 0) && (def_file.groups[0].frames.size() > std::get<1>(tile_info)))
-				{
-					auto special_tile_iter = special_tiles_map.find(std::get<0>(tile_info));
-					if (special_tile_iter == special_tiles_map.end())
-					{
-						result->m_texture_atlas.insertItem(TextureItem(std::get<0>(tile_info), 0, std::get<1>(tile_info), -1), QSize(def_file.fullWidth, def_file.fullHeight));
-					}
-					else
-					{
-						for (int frame = 0; frame < std::get<1>(special_tile_iter->second); ++frame)
-						{
-							result->m_texture_atlas.insertItem(TextureItem(std::get<0>(tile_info), 0, std::get<1>(tile_info), frame), QSize(def_file.fullWidth, def_file.fullHeight));
-						}
-					}
-				}
+	if (result->m_map)
+	{
+		// load terrain, rivers and roads
+		for (int level_index = 0; level_index < level_count; ++level_index)
+		{
+			const int map_level = first_level + level_index;
 
-				auto river_info = getRiverTile(result->m_map, tile_x, tile_y, result->m_level);
-				if (!std::get<0>(river_info).empty())
+			for (int tile_y = 0; tile_y < getMapHeight(result->m_map); ++tile_y)
+			{
+				for (int tile_x = 0; tile_x < getMapWidth(result->m_map); ++tile_x)
 				{
-					++total_squares;
-					def_file = load_def_file_func(std::get<0>(river_info), -1);
+					auto tile_info = getTerrainTile(result->m_map, tile_x, tile_y, map_level);
+
+					const size_t tile_index = (level_index * getMapHeight(result->m_map) + tile_y) * getMapWidth(result->m_map) + tile_x;
 
-					if ((def_file.type != DefType::unknown) && (def_file.groups.size() > 0) && (def_file.groups[0].frames.size() > std::get<1>(river_info)))
+					terrain_images[tile_index] = insert_tile_func(std::get<0>(tile_info), std::get<1>(tile_info), load_def_header_func(std::get<0>(tile_info)));
+
+					auto river_info = getRiverTile(result->m_map, tile_x, tile_y, map_level);
+					if (!std::get<0>(river_info).empty())
 					{
-						auto special_tile_iter = special_tiles_map.find(std::get<0>(river_info));
-						if (special_tile_iter == special_tiles_map.end())
-						{
-							result->m_texture_atlas.insertItem(TextureItem(std::get<0>(river_info), 0, std::get<1>(river_info), -1), QSize(def_file.fullWidth, def_file.fullHeight));
-						}
-						else
-						{
-							for (int frame = 0; frame < std::get<1>(special_tile_iter->second); ++frame)
-							{
-								result->m_texture_atlas.insertItem(TextureItem(std::get<0>(river_info), 0, std::get<1>(river_info), frame), QSize(def_file.fullWidth, def_file.fullHeight));
-							}
-						}
+						river_images[tile_index] = insert_tile_func(std::get<0>(river_info), std::get<1>(river_info), load_def_header_func(std::get<0>(river_info)));
 					}
-				}
 
-				auto road_info = getRoadTile(result->m_map, tile_x, tile_y, result->m_level);
-				if (!std::get<0>(road_info).empty())
-				{
-					++total_squares;
-					def_file = load_def_file_func(std::get<0>(road_info), -1);
-
-					if ((def_file.type != DefType::unknown) && (def_file.groups.size() > 0) && (def_file.groups[0].frames.size() > std::get<1>(road_info)))
+					auto road_info = getRoadTile(result->m_map, tile_x, tile_y, map_level);
+					if (!std::get<0>(road_info).empty())
 					{
-						result->m_texture_atlas.insertItem(TextureItem(std::get<0>(road_info), 0, std::get<1>(road_info), -1), QSize(def_file.fullWidth, def_file.fullHeight));
+						road_images[tile_index] = insert_tile_func(std::get<0>(road_info), std::get<1>(road_info), load_def_header_func(std::get<0>(road_info)));
 					}
 				}
 			}
@@ -390,12 +665,16 @@ void Homm3MapLoader::loadMapData(QString map_name, std::shared_ptr<CMap> map, in
 				continue;
 			}
 
-			if ((*iter)->pos.z != result->m_level)
+			const int level_index = (*iter)->pos.z - first_level;
+
+			if ((level_index < 0) || (level_index >= level_count))
 			{
-				// skip another map level
+				// skip levels which are not prepared
 				continue;
 			}
 
+			auto &level_objects = map_objects[level_index];
+
 			MapItemPosition pos;
 
 			pos.x = (*iter)->pos.x;
@@ -409,7 +688,7 @@ void Homm3MapLoader::loadMapData(QString map_name, std::shared_ptr<CMap> map, in
 
 			pos.isVisitable = (*iter)->appearance.isVisitable;
 
-			MapItem item { (*iter)->appearance.animationFile };
+			MapItem item((*iter)->appearance.animationFile, &loader_arena);
 
 			// lowercase name
 			std::transform(item.name.begin(), item.name.end(), item.name.begin(), [](unsigned char c) { return tolower(c); });
@@ -421,42 +700,22 @@ void Homm3MapLoader::loadMapData(QString map_name, std::shared_ptr<CMap> map, in
 			}
 
 			++total_squares;
-			Def def_file = load_def_file_func(item.name, item.special);
-
-			if ((def_file.type != DefType::unknown) && (def_file.groups.size() > item.group) && (def_file.groups[item.group].frames.size() > 0))
-			{
-				item.total_frames = def_file.groups[item.group].frames.size();
-
-				for (size_t frame = 0; frame < def_file.groups[item.group].frames.size(); ++frame)
-				{
-					result->m_texture_atlas.insertItem(TextureItem(item.name, item.group, frame, item.special), QSize(def_file.fullWidth, def_file.fullHeight));
-				}
-			}
+			insert_object_func(item, load_def_header_func(item.name));
 
 			// heroes have flags, insert flag before hero
 			if (((*iter)->ID == Obj::HERO) || ((*iter)->ID == Obj::RANDOM_HERO) || ((*iter)->ID == Obj::HERO_PLACEHOLDER))
 			{
 				auto index = std::min<int>(std::max<int>(static_cast<int>((*iter)->tempOwner), 0), hero_flags_map.size() - 1);
-				MapItem flag_item { hero_flags_map[index].first };
+				MapItem flag_item(hero_flags_map[index].first, &loader_arena);
 				flag_item.group = hero_flags_map[index].second;
 
 				++total_squares;
-				def_file = load_def_file_func(flag_item.name, flag_item.special);
-
-				if ((def_file.type != DefType::unknown) && (def_file.groups.size() > flag_item.group) && (def_file.groups[flag_item.group].frames.size() > 0))
-				{
-					flag_item.total_frames = def_file.groups[flag_item.group].frames.size();
+				insert_object_func(flag_item, load_def_header_func(flag_item.name));
 
-					for (size_t frame = 0; frame < def_file.groups[flag_item.group].frames.size(); ++frame)
-					{
-						result->m_texture_atlas.insertItem(TextureItem(flag_item.name, flag_item.group, frame, flag_item.special), QSize(def_file.fullWidth, def_file.fullHeight));
-					}
-				}
-
-				map_objects[pos].push_back(flag_item);
+				level_objects[pos].push_back(flag_item);
 			}
 
-			map_objects[pos].push_back(item);
+			level_objects[pos].push_back(item);
 
 			// castles may have heroes
 			if (((*iter)->ID == Obj::TOWN) || ((*iter)->ID == Obj::RANDOM_TOWN))
@@ -478,508 +737,763 @@ void Homm3MapLoader::loadMapData(QString map_name, std::shared_ptr<CMap> map, in
 						hero_pos.isHero = true;
 						hero_pos.isVisitable = false;
 
-						MapItem hero_item { hero_picture };
+						MapItem hero_item(hero_picture, &loader_arena);
 
-						def_file = load_def_file_func(hero_item.name, hero_item.special);
-
-						if ((def_file.type != DefType::unknown) && (def_file.groups.size() > hero_item.group) && (def_file.groups[hero_item.group].frames.size() > 0))
-						{
-							hero_item.total_frames = def_file.groups[hero_item.group].frames.size();
-
-							for (size_t frame = 0; frame < def_file.groups[hero_item.group].frames.size(); ++frame)
-							{
-								result->m_texture_atlas.insertItem(TextureItem(hero_item.name, hero_item.group, frame, hero_item.special), QSize(def_file.fullWidth, def_file.fullHeight));
-							}
-						}
+						insert_object_func(hero_item, load_def_header_func(hero_item.name));
 
 						auto index = std::min<int>(std::max<int>(static_cast<int>((*iter)->tempOwner), 0), hero_flags_map.size() - 1);
-						MapItem flag_item { hero_flags_map[index].first };
+						MapItem flag_item(hero_flags_map[index].first, &loader_arena);
 						flag_item.group = hero_flags_map[index].second;
 
-						def_file = load_def_file_func(flag_item.name, flag_item.special);
-
-						if ((def_file.type != DefType::unknown) && (def_file.groups.size() > flag_item.group) && (def_file.groups[flag_item.group].frames.size() > 0))
-						{
-							flag_item.total_frames = def_file.groups[flag_item.group].frames.size();
-
-							for (size_t frame = 0; frame < def_file.groups[flag_item.group].frames.size(); ++frame)
-							{
-								result->m_texture_atlas.insertItem(TextureItem(flag_item.name, flag_item.group, frame, flag_item.special), QSize(def_file.fullWidth, def_file.fullHeight));
-							}
-						}
+						insert_object_func(flag_item, load_def_header_func(flag_item.name));
 
 						// insert flag before hero
 						total_squares += 2;
-						map_objects[hero_pos].push_back(flag_item);
-						map_objects[hero_pos].push_back(hero_item);
+						level_objects[hero_pos].push_back(flag_item);
+						level_objects[hero_pos].push_back(hero_item);
 					}
 				}
 			}
 		}
 	}
 
-	// images loaded, construct texture
-	const auto atlas_size = result->m_texture_atlas.getSize();
+	// image headers are not needed anymore
+	def_headers_map.clear();
 
-	{
-		result->m_texture_data.resize(atlas_size * atlas_size * 4, 0);
+	stage_timer.emplace(result->m_statistics, LoadStage::composition);
 
-		static const uint8_t transparency_palette[] = { 0x00, 0x40, 0x00, 0x00, 0x80, 0xff, 0x80, 0x40 };
+	// all images are known, decode them and keep only frames which differ from all previous ones
+	static const uint8_t transparency_palette[] = { 0x00, 0x40, 0x00, 0x00, 0x80, 0xff, 0x80, 0x40 };
 
-		auto shift_palette_idx_func = [](int base_idx, int current_idx, int total_frames, int current_frame) -> int
-		{
-			return base_idx + (((total_frames - (current_frame % total_frames)) + (current_idx - base_idx)) % total_frames);
-		};
+	auto shift_palette_idx_func = [](int base_idx, int current_idx, int total_frames, int current_frame) -> int
+	{
+		return base_idx + (((total_frames - (current_frame % total_frames)) + (current_idx - base_idx)) % total_frames);
+	};
 
-		auto items = result->m_texture_atlas.getAllItems();
-		for (auto item = items.first; item != items.second; ++item)
+	// group texture items by image file, so that each file is decoded and released before the next one
+	std::pmr::map<std::tuple<std::pmr::string, int>, std::pmr::vector<TextureHandle> > compose_queue(&loader_arena);
+
+	for (TextureHandle handle = 0; handle < result->m_texture_atlas.getItemsCount(); ++handle)
+	{
+		if (handle == TextureAtlas::invalid_handle)
 		{
-			const std::string &def_name = item->first.name;
-			auto group_idx = item->first.group;
-			auto frame_idx = item->first.frame;
-			auto special_idx = item->first.special;
-			auto special_tile_type = SpecialTile::none;
-			auto special_frame = -1;
+			continue;
+		}
 
-			if (def_name == "invalid")
-			{
-				continue;
-			}
+		const auto &item = result->m_texture_atlas.getItem(handle);
 
-			auto special_tile_iter = special_tiles_map.find(def_name);
-			if (special_tile_iter != special_tiles_map.end())
-			{
-				special_tile_type = std::get<0>(special_tile_iter->second);
-				special_frame = special_idx;
-				special_idx = -1;
-			}
+		compose_queue[std::make_tuple(std::pmr::string(item.name, &loader_arena), item.special)].push_back(handle);
+	}
 
-			auto def_iter = defs_map.find(std::tie(def_name, special_idx));
-			if ((def_iter != defs_map.end()) && (def_iter->second.groups.size() > group_idx) && (def_iter->second.groups[group_idx].frames.size() > frame_idx))
-			{
-				const Def &image_def = def_iter->second;
-				const DefFrame &frame = image_def.groups[group_idx].frames[frame_idx];
+	// palettes of all images are rows of one texture, first row is transparent and is used by images which failed to load
+	std::pmr::map<std::pmr::vector<uint8_t>, size_t> palette_rows_index(&loader_arena);
+	std::pmr::vector<PaletteRows> item_palettes(result->m_texture_atlas.getItemsCount(), PaletteRows(), &loader_arena);
 
-				for (int64_t y = 0; y < frame.height; ++y)
-				{
-					for (int64_t x = 0; x < frame.width; ++x)
-					{
-						uint32_t idx = frame.data[y * frame.width + x];
-
-						switch (special_tile_type)
-						{
-						case SpecialTile::none:
-						default:
-							break;
-
-						case SpecialTile::lavatl:
-							if (idx >= 246 && idx < 246 + 9)
-							{
-								idx = shift_palette_idx_func(246, idx, 9, special_frame);
-							}
-							break;
-
-						case SpecialTile::watrtl:
-							if (idx >= 229 && idx < 229 + 12)
-							{
-								idx = shift_palette_idx_func(229, idx, 12, special_frame);
-							}
-							else if (idx >= 242 && idx < 242 + 14)
-							{
-								idx = shift_palette_idx_func(242, idx, 14, special_frame);
-							}
-							break;
-
-						case SpecialTile::clrrvr:
-							if (idx >= 183 && idx < 183 + 12)
-							{
-								idx = shift_palette_idx_func(183, idx, 12, special_frame);
-							}
-							else if (idx >= 195 && idx < 195 + 6)
-							{
-								idx = shift_palette_idx_func(195, idx, 6, special_frame);
-							}
-							break;
-
-						case SpecialTile::mudrvr:
-							if (idx >= 228 && idx < 228 + 12)
-							{
-								idx = shift_palette_idx_func(228, idx, 12, special_frame);
-							}
-							else if (idx >= 183 && idx < 183 + 6)
-							{
-								idx = shift_palette_idx_func(183, idx, 6, special_frame);
-							}
-							else if (idx >= 240 && idx < 240 + 6)
-							{
-								idx = shift_palette_idx_func(240, idx, 6, special_frame);
-							}
-							break;
-
-						case SpecialTile::lavrvr:
-							if (idx >= 240 && idx < 240 + 9)
-							{
-								idx = shift_palette_idx_func(240, idx, 9, special_frame);
-							}
-							break;
-						}
-
-						result->m_texture_data[((item->second.y() + frame.y + y) * atlas_size + item->second.x() + frame.x + x) * 4    ] = image_def.rawPalette[idx * 3];
-						result->m_texture_data[((item->second.y() + frame.y + y) * atlas_size + item->second.x() + frame.x + x) * 4 + 1] = image_def.rawPalette[idx * 3 + 1];
-						result->m_texture_data[((item->second.y() + frame.y + y) * atlas_size + item->second.x() + frame.x + x) * 4 + 2] = image_def.rawPalette[idx * 3 + 2];
-						result->m_texture_data[((item->second.y() + frame.y + y) * atlas_size + item->second.x() + frame.x + x) * 4 + 3] = (idx < sizeof(transparency_palette)) ? transparency_palette[idx] : 0xFF;
-					}
-				}
-			}
-		}
+	result->m_palette_data.assign(palette_row_size, 0);
 
-		defs_map.clear();
-	}
+	std::pmr::vector<DecodedImage> decoded_images(&loader_arena);
+	std::pmr::unordered_multimap<uint64_t, size_t> decoded_images_index(&loader_arena);
+	std::pmr::vector<const DefFrame*> item_frames(&loader_arena);
 
-	// now add vertices with texture coordinates
-	QRect tex_rect;
+	// every item is decoded at most once
+	decoded_images.reserve(result->m_texture_atlas.getItemsCount());
+	decoded_images_index.reserve(result->m_texture_atlas.getItemsCount());
 
-	result->m_vertices.reserve(total_squares * 6);
-	result->m_texcoords.reserve(total_squares * 6);
+	size_t peak_decoded_size = 0;
+	size_t total_decoded_size = 0;
+	size_t kept_frames_size = 0;
+	size_t duplicate_frames = 0;
 
-	if (result->m_map)
+	for (auto queue_iter = compose_queue.begin(); queue_iter != compose_queue.end(); ++queue_iter)
 	{
-		// draw terrain, rivers
-		for (int tile_y = 0; tile_y < getMapHeight(result->m_map); ++tile_y)
+		const std::string image_name(std::get<0>(queue_iter->first));
+		std::shared_ptr<const Def> image_def_ptr;
+
 		{
-			for (int tile_x = 0; tile_x < getMapWidth(result->m_map); ++tile_x)
-			{
-				auto tile_info = getTerrainTile(result->m_map, tile_x, tile_y, result->m_level);
+			LoadStageTimer decode_timer(result->m_statistics, LoadStage::def_decode);
+			image_def_ptr = loadDefFile(*m_archives, image_name, std::get<1>(queue_iter->first));
+		}
 
-				int special_terrain_index = -1;
+		if (!image_def_ptr)
+		{
+			continue;
+		}
 
-				{
-					auto special_terrain_iter = special_tiles_map.find(std::get<0>(tile_info));
-					if (special_terrain_iter != special_tiles_map.end())
-					{
-						special_terrain_index = result->m_current_frames[std::get<1>(special_terrain_iter->second)];
+		const Def &image_def = *image_def_ptr;
 
-						AnimatedItem item;
+		const size_t decoded_size = getDefDataSize(image_def);
+		peak_decoded_size = std::max(peak_decoded_size, loader_arena_upstream.getAllocatedBytes() + decoded_size);
+		total_decoded_size += decoded_size;
 
-						item.name = std::get<0>(tile_info);
-						item.group = std::get<1>(tile_info);
-						item.total_frames = std::get<1>(special_terrain_iter->second);
-						item.is_terrain = true;
+		// special tiles take one palette row for each animation frame
+		auto special_tile_type = SpecialTile::none;
+		int palette_frames = 1;
 
-						result->m_animated_items[item][std::get<2>(tile_info)].insert(result->m_texcoords.size());
-					}
-				}
+		auto special_tile_iter = special_tiles_map.find(image_name);
+		if (special_tile_iter != special_tiles_map.end())
+		{
+			special_tile_type = std::get<0>(special_tile_iter->second);
+			palette_frames = std::get<1>(special_tile_iter->second);
+		}
+
+		std::pmr::vector<uint8_t> palette_rows_data(palette_frames * palette_row_size, 0, &loader_arena);
+
+		for (int special_frame = 0; special_frame < palette_frames; ++special_frame)
+		{
+			uint8_t *palette = palette_rows_data.data() + special_frame * palette_row_size;
 
-				result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 1) * tile_size, 0));
-				result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 1) * tile_size, 0));
-				result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 2) * tile_size, 0));
-				result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 1) * tile_size, 0));
-				result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 2) * tile_size, 0));
-				result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 2) * tile_size, 0));
-
-				tex_rect = result->m_texture_atlas.findItem(TextureItem(std::get<0>(tile_info), 0, std::get<1>(tile_info), special_terrain_index));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(tile_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(tile_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(tile_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(tile_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(tile_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(tile_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(tile_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(tile_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(tile_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(tile_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(tile_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(tile_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-
-				auto river_info = getRiverTile(result->m_map, tile_x, tile_y, result->m_level);
-				if (!std::get<0>(river_info).empty())
+			for (uint32_t palette_idx = 0; palette_idx < 256; ++palette_idx)
+			{
+				uint32_t idx = palette_idx;
+
+				switch (special_tile_type)
 				{
-					int special_river_index = -1;
+				case SpecialTile::none:
+				default:
+					break;
 
+				case SpecialTile::lavatl:
+					if (idx >= 246 && idx < 246 + 9)
 					{
-						auto special_river_iter = special_tiles_map.find(std::get<0>(river_info));
-						if (special_river_iter != special_tiles_map.end())
-						{
-							special_river_index = result->m_current_frames[std::get<1>(special_river_iter->second)];
+						idx = shift_palette_idx_func(246, idx, 9, special_frame);
+					}
+					break;
 
-							AnimatedItem item;
+				case SpecialTile::watrtl:
+					if (idx >= 229 && idx < 229 + 12)
+					{
+						idx = shift_palette_idx_func(229, idx, 12, special_frame);
+					}
+					else if (idx >= 242 && idx < 242 + 14)
+					{
+						idx = shift_palette_idx_func(242, idx, 14, special_frame);
+					}
+					break;
 
-							item.name = std::get<0>(river_info);
-							item.group = std::get<1>(river_info);
-							item.total_frames = std::get<1>(special_river_iter->second);
-							item.is_terrain = true;
+				case SpecialTile::clrrvr:
+					if (idx >= 183 && idx < 183 + 12)
+					{
+						idx = shift_palette_idx_func(183, idx, 12, special_frame);
+					}
+					else if (idx >= 195 && idx < 195 + 6)
+					{
+						idx = shift_palette_idx_func(195, idx, 6, special_frame);
+					}
+					break;
 
-							result->m_animated_items[item][std::get<2>(river_info)].insert(result->m_texcoords.size());
-						}
+				case SpecialTile::mudrvr:
+					if (idx >= 228 && idx < 228 + 12)
+					{
+						idx = shift_palette_idx_func(228, idx, 12, special_frame);
 					}
+					else if (idx >= 183 && idx < 183 + 6)
+					{
+						idx = shift_palette_idx_func(183, idx, 6, special_frame);
+					}
+					else if (idx >= 240 && idx < 240 + 6)
+					{
+						idx = shift_palette_idx_func(240, idx, 6, special_frame);
+					}
+					break;
 
-					result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 1) * tile_size, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 1) * tile_size, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 2) * tile_size, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 1) * tile_size, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 2) * tile_size, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 2) * tile_size, 0));
-
-					tex_rect = result->m_texture_atlas.findItem(TextureItem(std::get<0>(river_info), 0, std::get<1>(river_info), special_river_index));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(river_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(river_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(river_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(river_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(river_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(river_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(river_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(river_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(river_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(river_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(river_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(river_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
+				case SpecialTile::lavrvr:
+					if (idx >= 240 && idx < 240 + 9)
+					{
+						idx = shift_palette_idx_func(240, idx, 9, special_frame);
+					}
+					break;
 				}
+
+				palette[palette_idx * 4    ] = image_def.rawPalette[idx * 3];
+				palette[palette_idx * 4 + 1] = image_def.rawPalette[idx * 3 + 1];
+				palette[palette_idx * 4 + 2] = image_def.rawPalette[idx * 3 + 2];
+				palette[palette_idx * 4 + 3] = (idx < sizeof(transparency_palette)) ? transparency_palette[idx] : 0xFF;
 			}
 		}
 
-		// draw roads
-		for (int tile_y = 0; tile_y < getMapHeight(result->m_map); ++tile_y)
+		// most images use same palette, so it's stored only once
+		auto palette_rows_iter = palette_rows_index.find(palette_rows_data);
+		if (palette_rows_iter == palette_rows_index.end())
 		{
-			for (int tile_x = 0; tile_x < getMapWidth(result->m_map); ++tile_x)
-			{
-				auto road_info = getRoadTile(result->m_map, tile_x, tile_y, result->m_level);
-				if (!std::get<0>(road_info).empty())
-				{
-					result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 1) * tile_size + tile_size / 2, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 1) * tile_size + tile_size / 2, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 2) * tile_size + tile_size / 2, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 1) * tile_size + tile_size / 2, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 1) * tile_size, (tile_y + 2) * tile_size + tile_size / 2, 0));
-					result->m_vertices.push_back(QVector3D((tile_x + 2) * tile_size, (tile_y + 2) * tile_size + tile_size / 2, 0));
-
-					tex_rect = result->m_texture_atlas.findItem(TextureItem(std::get<0>(road_info), 0, std::get<1>(road_info), -1));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(road_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(road_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(road_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(road_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(road_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(road_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(road_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(road_info) / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(road_info) % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(road_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-					result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + ((std::get<2>(road_info) % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((std::get<2>(road_info) / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size)));
-				}
-			}
+			palette_rows_iter = palette_rows_index.emplace(palette_rows_data, result->m_palette_data.size() / palette_row_size).first;
+			result->m_palette_data.insert(result->m_palette_data.end(), palette_rows_data.begin(), palette_rows_data.end());
 		}
 
-		// draw objects
-		for (auto pos_iter = map_objects.begin(); pos_iter != map_objects.end(); ++pos_iter)
+		PaletteRows palette_rows;
+		palette_rows.first = palette_rows_iter->second;
+		palette_rows.count = palette_frames;
+
+		for (auto item_iter = queue_iter->second.begin(); item_iter != queue_iter->second.end(); ++item_iter)
 		{
-			for (auto object_iter = pos_iter->second.begin(); object_iter != pos_iter->second.end(); ++object_iter)
-			{
-				int frame = 0;
+			const auto &item = result->m_texture_atlas.getItem(*item_iter);
+			const auto &item_position = result->m_texture_atlas.getPosition(*item_iter);
 
-				if (object_iter->total_frames > 1)
-				{
-					frame = result->m_current_frames[object_iter->total_frames];
+			// frames of animated images may be smaller than bounds of their item
+			const auto item_size = item_position.rect.size();
+			auto group_idx = item.group;
 
-					AnimatedItem item;
+			item_palettes[*item_iter] = palette_rows;
 
-					item.name = object_iter->name;
-					item.group = object_iter->group;
-					item.special = object_iter->special;
-					item.total_frames = object_iter->total_frames;
-					item.is_terrain = false;
+			if (image_def.groups.size() <= group_idx)
+			{
+				continue;
+			}
 
-					result->m_animated_items[item][0].insert(result->m_texcoords.size());
-				}
+			item_frames.clear();
 
-				tex_rect = result->m_texture_atlas.findItem(TextureItem(object_iter->name, object_iter->group, frame, object_iter->special));
-
-				result->m_vertices.push_back(QVector3D((pos_iter->first.x + 2) * tile_size - tex_rect.width(), (pos_iter->first.y + 2) * tile_size - tex_rect.height(), 0));
-				result->m_vertices.push_back(QVector3D((pos_iter->first.x + 2) * tile_size,                    (pos_iter->first.y + 2) * tile_size - tex_rect.height(), 0));
-				result->m_vertices.push_back(QVector3D((pos_iter->first.x + 2) * tile_size - tex_rect.width(), (pos_iter->first.y + 2) * tile_size,                     0));
-				result->m_vertices.push_back(QVector3D((pos_iter->first.x + 2) * tile_size,                    (pos_iter->first.y + 2) * tile_size - tex_rect.height(), 0));
-				result->m_vertices.push_back(QVector3D((pos_iter->first.x + 2) * tile_size - tex_rect.width(), (pos_iter->first.y + 2) * tile_size,                     0));
-				result->m_vertices.push_back(QVector3D((pos_iter->first.x + 2) * tile_size,                    (pos_iter->first.y + 2) * tile_size,                     0));
-
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-				result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
+			for (size_t frame_idx = item.frame; (frame_idx < item.frame + item_position.frames) && (frame_idx < image_def.groups[group_idx].frames.size()); ++frame_idx)
+			{
+				item_frames.push_back(&(image_def.groups[group_idx].frames[frame_idx]));
 			}
-		}
-	}
 
-	// top left edge
-	result->m_vertices.push_back(QVector3D(0, 0, 0));
-	result->m_vertices.push_back(QVector3D(tile_size, 0, 0));
-	result->m_vertices.push_back(QVector3D(0, tile_size, 0));
-	result->m_vertices.push_back(QVector3D(tile_size, 0, 0));
-	result->m_vertices.push_back(QVector3D(0, tile_size, 0));
-	result->m_vertices.push_back(QVector3D(tile_size, tile_size, 0));
+			if (item_frames.empty())
+			{
+				continue;
+			}
 
-	tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, 16, -1));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
+			// images repeated inside one file, same images in different files and
+			// player color variants of same image all share one place in atlas
+			const uint64_t image_hash = getImageHash(item_size, item_position.offset, item_frames);
+			bool is_duplicate = false;
 
-	// top right edge
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, 0, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, 0, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, 0, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, tile_size, 0));
-
-	tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, 17, -1));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
+			auto candidates = decoded_images_index.equal_range(image_hash);
+			for (auto candidate_iter = candidates.first; candidate_iter != candidates.second; ++candidate_iter)
+			{
+				const auto &candidate = decoded_images[candidate_iter->second];
 
-	// bottom right edge
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-
-	tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, 18, -1));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-
-	// bottom left edge
-	result->m_vertices.push_back(QVector3D(0, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D(tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D(0, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D(tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D(0, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-	result->m_vertices.push_back(QVector3D(tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-
-	tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, 19, -1));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-
-	// randomize edges
-	top_edge.resize(getMapWidth(result->m_map));
-	right_edge.resize(getMapHeight(result->m_map));
-	bottom_edge.resize(getMapWidth(result->m_map));
-	left_edge.resize(getMapHeight(result->m_map));
-
-	for (auto i = 0; i < getMapWidth(result->m_map); ++i)
-	{
-		top_edge[i] = CRandomGenerator::instance().nextInt<int>(20, 23);
-	}
-
-	for (auto i = 0; i < getMapHeight(result->m_map); ++i)
-	{
-		right_edge[i] = CRandomGenerator::instance().nextInt<int>(24, 27);
-	}
-
-	for (auto i = 0; i < getMapWidth(result->m_map); ++i)
-	{
-		bottom_edge[i] = CRandomGenerator::instance().nextInt<int>(28, 31);
-	}
-
-	for (auto i = 0; i < getMapHeight(result->m_map); ++i)
-	{
-		left_edge[i] = CRandomGenerator::instance().nextInt<int>(32, 35);
-	}
-
-	// top edge
-	for (auto i = 0; i < getMapWidth(result->m_map); ++i)
-	{
-		result->m_vertices.push_back(QVector3D((i + 1) * tile_size, 0, 0));
-		result->m_vertices.push_back(QVector3D((i + 2) * tile_size, 0, 0));
-		result->m_vertices.push_back(QVector3D((i + 1) * tile_size, tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 2) * tile_size, 0, 0));
-		result->m_vertices.push_back(QVector3D((i + 1) * tile_size, tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 2) * tile_size, tile_size, 0));
-
-		tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, top_edge[i], -1));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	}
-
-	// right edge
-	for (auto i = 0; i < getMapHeight(result->m_map); ++i)
-	{
-		result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, (i + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, (i + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, (i + 2) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, (i + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 1) * tile_size, (i + 2) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((getMapWidth(result->m_map) + 2) * tile_size, (i + 2) * tile_size, 0));
-
-		tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, right_edge[i], -1));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	}
+				// common images may only use other common images, otherwise their pages would depend on map
+				if (result->m_texture_atlas.isCommonItem(*item_iter) && (!result->m_texture_atlas.isCommonItem(candidate.handle)))
+				{
+					continue;
+				}
 
-	// bottom edge
-	for (auto i = 0; i < getMapWidth(result->m_map); ++i)
-	{
-		result->m_vertices.push_back(QVector3D((i + 1) * tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 2) * tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 1) * tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 2) * tile_size, (getMapHeight(result->m_map) + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 1) * tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D((i + 2) * tile_size, (getMapHeight(result->m_map) + 2) * tile_size, 0));
+				if (imagesAreEqual(candidate, item_size, item_position.offset, item_frames))
+				{
+					result->m_texture_atlas.setDuplicate(*item_iter, candidate.handle);
+					is_duplicate = true;
+					break;
+				}
+			}
 
-		tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, bottom_edge[i], -1));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	}
+			if (is_duplicate)
+			{
+				duplicate_frames += item_frames.size();
+				continue;
+			}
 
-	// left edge
-	for (auto i = 0; i < getMapHeight(result->m_map); ++i)
-	{
-		result->m_vertices.push_back(QVector3D(0, (i + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D(tile_size, (i + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D(0, (i + 2) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D(tile_size, (i + 1) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D(0, (i + 2) * tile_size, 0));
-		result->m_vertices.push_back(QVector3D(tile_size, (i + 2) * tile_size, 0));
+			DecodedImage decoded_image(&loader_arena);
 
-		tex_rect = result->m_texture_atlas.findItem(TextureItem("edg.def", 0, left_edge[i], -1));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-		result->m_texcoords.push_back(QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size)));
-	}
+			decoded_image.handle = *item_iter;
+			decoded_image.size = item_size;
 
-	Q_EMIT mapLoaded(result);
-}
+			size_t decoded_image_size = 0;
 
-Homm3MapRenderer::Homm3MapRenderer()
+			for (const DefFrame *frame: item_frames)
+			{
+				decoded_image_size += static_cast<size_t>(frame->width) * frame->height;
+			}
+
+			decoded_image.frames.reserve(item_frames.size());
+			decoded_image.data.reserve(decoded_image_size);
+
+			for (const DefFrame *frame: item_frames)
+			{
+				DecodedFrame decoded_frame;
+
+				decoded_frame.x = frame->x - item_position.offset.x();
+				decoded_frame.y = frame->y - item_position.offset.y();
+				decoded_frame.width = frame->width;
+				decoded_frame.height = frame->height;
+				decoded_frame.data_offset = decoded_image.data.size();
+
+				decoded_image.frames.push_back(decoded_frame);
+				decoded_image.data.insert(decoded_image.data.end(), frame->data.begin(), frame->data.begin() + static_cast<size_t>(frame->width) * frame->height);
+			}
+
+			kept_frames_size += decoded_image.data.size();
+
+			decoded_images_index.emplace(image_hash, decoded_images.size());
+			decoded_images.push_back(std::move(decoded_image));
+		}
+	}
+
+	// place unique images
+	stage_timer.emplace(result->m_statistics, LoadStage::atlas_pack);
+
+	result->m_texture_atlas.pack(m_max_texture_size);
+
+	stage_timer.emplace(result->m_statistics, LoadStage::composition);
+
+	// images placed, construct textures of palette indices
+	size_t texture_bytes = result->m_palette_data.size();
+
+	result->m_texture_data.resize(result->m_texture_atlas.getPagesCount());
+
+	for (size_t page = 0; page < result->m_texture_data.size(); ++page)
+	{
+		const auto page_size = result->m_texture_atlas.getPageSize(page);
+
+		result->m_texture_data[page].resize(page_size.width() * page_size.height(), 0);
+		texture_bytes += result->m_texture_data[page].size();
+	}
+
+	for (const auto &decoded_image: decoded_images)
+	{
+		const auto &position = result->m_texture_atlas.getPosition(decoded_image.handle);
+
+		// images which don't fit into any page are not drawn
+		if (position.rect.isEmpty())
+		{
+			continue;
+		}
+
+		auto &page_data = result->m_texture_data[position.page];
+		const auto page_width = result->m_texture_atlas.getPageSize(position.page).width();
+
+		for (size_t frame = 0; frame < decoded_image.frames.size(); ++frame)
+		{
+			const auto &decoded_frame = decoded_image.frames[frame];
+
+			// frames of animated image follow each other in rows of grid
+			const int64_t frame_x = position.rect.x() + static_cast<int64_t>(frame % position.columns) * position.rect.width() + decoded_frame.x;
+			const int64_t frame_y = position.rect.y() + static_cast<int64_t>(frame / position.columns) * position.rect.height() + decoded_frame.y;
+
+			for (int64_t y = 0; y < decoded_frame.height; ++y)
+			{
+				memcpy(page_data.data() + (frame_y + y) * page_width + frame_x, decoded_image.data.data() + decoded_frame.data_offset + y * decoded_frame.width, decoded_frame.width);
+			}
+		}
+	}
+
+	result->m_page_hashes.reserve(result->m_texture_data.size());
+
+	for (size_t page = 0; page < result->m_texture_data.size(); ++page)
+	{
+		result->m_page_hashes.push_back(getPageHash(result->m_texture_atlas.getPageSize(page), result->m_texture_data[page]));
+	}
+
+	result->m_statistics.setCounter("composed_image_files", compose_queue.size());
+	result->m_statistics.setCounter("duplicate_frames", duplicate_frames);
+	// decoded files are released one after another, so at the end of composition arena holds most of memory used by it
+	result->m_statistics.setCounter("composition_peak_memory", std::max(peak_decoded_size, texture_bytes + loader_arena_upstream.getPeakBytes()));
+	result->m_statistics.setCounter("composition_kept_frames", kept_frames_size);
+	result->m_statistics.setCounter("composition_memory_all_images_decoded", texture_bytes + total_decoded_size);
+
+	stage_timer.emplace(result->m_statistics, LoadStage::vertex_build);
+
+	const int map_width = getMapWidth(result->m_map);
+	const int map_height = getMapHeight(result->m_map);
+	const int chunks_x = getChunkCoordinate(map_width - 1, map_width) + 1;
+	const int chunks_y = getChunkCoordinate(map_height - 1, map_height) + 1;
+	size_t last_chunk = std::numeric_limits<size_t>::max();
+
+	// now add sprites of objects and borders, they are never mirrored,
+	// x and y are top left corner of full image, but only its part stored in atlas is drawn,
+	// tile_x and tile_y are map tile which sprite belongs to, they choose chunk of sprite
+	auto add_sprite_func = [&result, &item_palettes, &last_chunk, map_width, map_height, chunks_x](int x, int y, TextureHandle handle, int tile_x, int tile_y) {
+		const auto &position = result->m_texture_atlas.getPosition(handle);
+		const auto &palette_rows = item_palettes[handle];
+		const size_t chunk = getChunkCoordinate(tile_y, map_height) * chunks_x + getChunkCoordinate(tile_x, map_width);
+
+		// texture coordinates are relative to page of current item, sprites are split into batches when page or chunk changes
+		if (result->m_draw_batches.empty() || (result->m_draw_batches.back().page != position.page) || (last_chunk != chunk))
+		{
+			DrawBatch batch;
+			batch.page = position.page;
+			batch.first = result->m_sprites.size();
+
+			result->m_draw_batches.push_back(batch);
+
+			last_chunk = chunk;
+		}
+
+		SpriteInstance sprite;
+		sprite.left = x + position.offset.x();
+		sprite.top = y + position.offset.y();
+		sprite.width = position.rect.width();
+		sprite.height = position.rect.height();
+		sprite.texture_x = position.rect.x();
+		sprite.texture_y = position.rect.y();
+		sprite.texture_width = position.rect.width();
+		sprite.texture_height = position.rect.height();
+		sprite.frames = position.frames;
+		sprite.columns = position.columns;
+		sprite.palette_first = palette_rows.first;
+		sprite.palette_rows = palette_rows.count;
+
+		result->m_sprites.push_back(sprite);
+
+		// all ground images are in atlas, but only palettes of drawn images decide when animation restarts
+		result->m_animation_cycle = addAnimationCycle(result->m_animation_cycle, palette_rows.count);
+
+		auto &bounds = result->m_draw_batches.back().bounds;
+		const QRect sprite_bounds(sprite.left, sprite.top, sprite.width, sprite.height);
+
+		bounds = bounds.isNull() ? sprite_bounds : bounds.united(sprite_bounds);
+	};
+
+	result->m_sprites.reserve(total_squares);
+
+	// ground items are numbered from one in order of their first use, zero means tile without image in its layer
+	std::pmr::vector<size_t> ground_indices(result->m_texture_atlas.getItemsCount(), 0, &loader_arena);
+	size_t ground_items = 0;
+
+	auto add_ground_tile_func = [&result, &item_palettes, &ground_indices, &ground_items, map_width, map_height](int layer, int tile_x, int tile_y, TextureHandle handle, int state) {
+		if (handle >= ground_indices.size())
+		{
+			handle = TextureAtlas::invalid_handle;
+		}
+
+		if (ground_indices[handle] == 0)
+		{
+			const auto &position = result->m_texture_atlas.getPosition(handle);
+			const auto &palette_rows = item_palettes[handle];
+
+			ground_indices[handle] = ++ground_items;
+
+			result->m_animation_cycle = addAnimationCycle(result->m_animation_cycle, palette_rows.count);
+
+			// ground images are not bigger than tile, so their visible bounds always fit into byte
+			const uint8_t texels[ground_item_texels * 4] = {
+				static_cast<uint8_t>(position.rect.x() & 0xFF), static_cast<uint8_t>(position.rect.x() >> 8),
+				static_cast<uint8_t>(position.rect.y() & 0xFF), static_cast<uint8_t>(position.rect.y() >> 8),
+				static_cast<uint8_t>(palette_rows.first & 0xFF), static_cast<uint8_t>(palette_rows.first >> 8),
+				static_cast<uint8_t>(std::min<size_t>(palette_rows.count, 0xFF)), static_cast<uint8_t>(position.page),
+				static_cast<uint8_t>(std::min(position.offset.x(), 0xFF)), static_cast<uint8_t>(std::min(position.offset.y(), 0xFF)),
+				static_cast<uint8_t>(std::min(position.rect.width(), 0xFF)), static_cast<uint8_t>(std::min(position.rect.height(), 0xFF)),
+			};
+
+			result->m_ground_items.insert(result->m_ground_items.end(), std::begin(texels), std::end(texels));
+
+			if (std::find(result->m_ground_pages.begin(), result->m_ground_pages.end(), position.page) == result->m_ground_pages.end())
+			{
+				result->m_ground_pages.push_back(position.page);
+			}
+		}
+
+		const size_t index = ground_indices[handle];
+		uint8_t *tile = result->m_ground_tiles.data() + ((static_cast<size_t>(layer) * map_height + tile_y) * map_width + tile_x) * 4;
+
+		tile[0] = index & 0xFF;
+		tile[1] = (index >> 8) & 0xFF;
+		tile[2] = state;
+	};
+
+	// only palette animated ground and animated sprites change between frames,
+	// cells of map with any of them are merged into areas along rows of cells
+	const int cell_size = animation_cell_tiles * tile_size;
+	const int cells_x = (map_width + 2 + animation_cell_tiles - 1) / animation_cell_tiles;
+	const int cells_y = (map_height + 2 + animation_cell_tiles - 1) / animation_cell_tiles;
+	std::pmr::vector<uint8_t> animated_cells(static_cast<size_t>(cells_x) * cells_y, 0, &loader_arena);
+
+	auto mark_animated_func = [&animated_cells, cell_size, cells_x, cells_y](const QRect &bounds) {
+		const int first_x = std::clamp(bounds.left() / cell_size, 0, cells_x - 1);
+		const int last_x = std::clamp(bounds.right() / cell_size, 0, cells_x - 1);
+		const int first_y = std::clamp(bounds.top() / cell_size, 0, cells_y - 1);
+		const int last_y = std::clamp(bounds.bottom() / cell_size, 0, cells_y - 1);
+
+		for (int cell_y = first_y; cell_y <= last_y; ++cell_y)
+		{
+			std::fill_n(animated_cells.begin() + cell_y * cells_x + first_x, last_x - first_x + 1, 1);
+		}
+	};
+
+	// ground tiles of each level take rows of all its layers
+	const size_t level_ground_tiles = static_cast<size_t>(map_width) * map_height * ground_layers;
+
+	if (result->m_map)
+	{
+		result->m_ground_tiles.resize(level_ground_tiles * level_count * 4, 0);
+	}
+
+	for (int level_index = 0; level_index < level_count; ++level_index)
+	{
+		const int map_level = first_level + level_index;
+		const int first_layer = level_index * ground_layers;
+		const size_t first_sprite = result->m_sprites.size();
+
+		MapLevel level_data;
+		level_data.level = map_level;
+		level_data.first_batch = result->m_draw_batches.size();
+		level_data.first_area = result->m_animated_areas.size();
+
+		// levels never share batches
+		last_chunk = std::numeric_limits<size_t>::max();
+
+		if (result->m_map)
+		{
+			// terrain, rivers and roads
+			for (int tile_y = 0; tile_y < map_height; ++tile_y)
+			{
+				for (int tile_x = 0; tile_x < map_width; ++tile_x)
+				{
+					const size_t tile_index = (level_index * map_height + tile_y) * map_width + tile_x;
+
+					auto tile_info = getTerrainTile(result->m_map, tile_x, tile_y, map_level);
+					add_ground_tile_func(first_layer, tile_x, tile_y, terrain_images[tile_index], std::get<2>(tile_info));
+
+					auto river_info = getRiverTile(result->m_map, tile_x, tile_y, map_level);
+					if (!std::get<0>(river_info).empty())
+					{
+						add_ground_tile_func(first_layer + 1, tile_x, tile_y, river_images[tile_index], std::get<2>(river_info));
+					}
+
+					auto road_info = getRoadTile(result->m_map, tile_x, tile_y, map_level);
+					if (!std::get<0>(road_info).empty())
+					{
+						add_ground_tile_func(first_layer + 2, tile_x, tile_y, road_images[tile_index], std::get<2>(road_info));
+					}
+				}
+			}
+
+			// draw objects, their bottom right corner is at bottom right corner of their tile.
+			// Objects overlap each other, so they are kept in print order, and each batch holds objects of one chunk placed one after another
+			const auto &level_objects = map_objects[level_index];
+
+			for (auto pos_iter = level_objects.begin(); pos_iter != level_objects.end(); ++pos_iter)
+			{
+				for (auto object_iter = pos_iter->second.begin(); object_iter != pos_iter->second.end(); ++object_iter)
+				{
+					const auto full_size = result->m_texture_atlas.getPosition(object_iter->handle).full_size;
+
+					add_sprite_func((pos_iter->first.x + 2) * tile_size - full_size.width(), (pos_iter->first.y + 2) * tile_size - full_size.height(), object_iter->handle, pos_iter->first.x, pos_iter->first.y);
+				}
+			}
+		}
+
+		// top left edge
+		add_sprite_func(0, 0, edge_images[16], -1, -1);
+
+		// top right edge
+		add_sprite_func((map_width + 1) * tile_size, 0, edge_images[17], map_width, -1);
+
+		// bottom right edge
+		add_sprite_func((map_width + 1) * tile_size, (map_height + 1) * tile_size, edge_images[18], map_width, map_height);
+
+		// bottom left edge
+		add_sprite_func(0, (map_height + 1) * tile_size, edge_images[19], -1, map_height);
+
+		// edges are random, but same for same map and level, so that map read from cache looks same as loaded one
+		const QByteArray edge_seed_name = map_name.toUtf8();
+
+		std::vector<uint32_t> edge_seed_values;
+		edge_seed_values.reserve(edge_seed_name.size() + 1);
+
+		for (const auto c: edge_seed_name)
+		{
+			edge_seed_values.push_back(static_cast<unsigned char>(c));
+		}
+
+		edge_seed_values.push_back(static_cast<uint32_t>(map_level));
+
+		std::seed_seq edge_seed(edge_seed_values.begin(), edge_seed_values.end());
+		CRandomGenerator edge_random(edge_seed);
+
+		top_edge.resize(getMapWidth(result->m_map));
+		right_edge.resize(getMapHeight(result->m_map));
+		bottom_edge.resize(getMapWidth(result->m_map));
+		left_edge.resize(getMapHeight(result->m_map));
+
+		for (auto i = 0; i < getMapWidth(result->m_map); ++i)
+		{
+			top_edge[i] = edge_random.nextInt<int>(20, 23);
+		}
+
+		for (auto i = 0; i < getMapHeight(result->m_map); ++i)
+		{
+			right_edge[i] = edge_random.nextInt<int>(24, 27);
+		}
+
+		for (auto i = 0; i < getMapWidth(result->m_map); ++i)
+		{
+			bottom_edge[i] = edge_random.nextInt<int>(28, 31);
+		}
+
+		for (auto i = 0; i < getMapHeight(result->m_map); ++i)
+		{
+			left_edge[i] = edge_random.nextInt<int>(32, 35);
+		}
+
+		// top edge
+		for (auto i = 0; i < getMapWidth(result->m_map); ++i)
+		{
+			add_sprite_func((i + 1) * tile_size, 0, edge_images[top_edge[i]], i, -1);
+		}
+
+		// right edge
+		for (auto i = 0; i < getMapHeight(result->m_map); ++i)
+		{
+			add_sprite_func((map_width + 1) * tile_size, (i + 1) * tile_size, edge_images[right_edge[i]], map_width, i);
+		}
+
+		// bottom edge
+		for (auto i = 0; i < getMapWidth(result->m_map); ++i)
+		{
+			add_sprite_func((i + 1) * tile_size, (map_height + 1) * tile_size, edge_images[bottom_edge[i]], i, map_height);
+		}
+
+		// left edge
+		for (auto i = 0; i < getMapHeight(result->m_map); ++i)
+		{
+			add_sprite_func(0, (i + 1) * tile_size, edge_images[left_edge[i]], -1, i);
+		}
+
+		for (auto sprite_iter = result->m_sprites.begin() + first_sprite; sprite_iter != result->m_sprites.end(); ++sprite_iter)
+		{
+			if ((sprite_iter->frames > 1) || (sprite_iter->palette_rows > 1))
+			{
+				mark_animated_func(QRect(sprite_iter->left, sprite_iter->top, sprite_iter->width, sprite_iter->height));
+			}
+		}
+
+		for (size_t tile = level_index * level_ground_tiles; tile < std::min((level_index + 1) * level_ground_tiles, result->m_ground_tiles.size() / 4); ++tile)
+		{
+			const size_t index = result->m_ground_tiles[tile * 4] | (result->m_ground_tiles[tile * 4 + 1] << 8);
+
+			// palette rows count is third byte of second texel of item
+			if ((index == 0) || (result->m_ground_items[(index - 1) * ground_item_texels * 4 + 6] <= 1))
+			{
+				continue;
+			}
+
+			const int layer = (tile / (static_cast<size_t>(map_width) * map_height)) % ground_layers;
+			const int tile_x = tile % map_width;
+			const int tile_y = (tile / map_width) % map_height;
+			const QPoint layer_origin = getGroundLayerOrigin(layer);
+
+			mark_animated_func(QRect(layer_origin.x() + tile_x * tile_size, layer_origin.y() + tile_y * tile_size, tile_size, tile_size));
+		}
+
+		for (int cell_y = 0; cell_y < cells_y; ++cell_y)
+		{
+			for (int cell_x = 0; cell_x < cells_x; ++cell_x)
+			{
+				if (!animated_cells[cell_y * cells_x + cell_x])
+				{
+					continue;
+				}
+
+				int last_x = cell_x;
+
+				while ((last_x + 1 < cells_x) && animated_cells[cell_y * cells_x + last_x + 1])
+				{
+					++last_x;
+				}
+
+				result->m_animated_areas.push_back(QRect(cell_x * cell_size, cell_y * cell_size, (last_x - cell_x + 1) * cell_size, cell_size));
+
+				cell_x = last_x;
+			}
+		}
+
+		std::fill(animated_cells.begin(), animated_cells.end(), 0);
+
+		level_data.batches = result->m_draw_batches.size() - level_data.first_batch;
+		level_data.areas = result->m_animated_areas.size() - level_data.first_area;
+
+		result->m_levels.push_back(level_data);
+	}
+
+	// each batch lasts until the next one
+	for (size_t i = 0; i < result->m_draw_batches.size(); ++i)
+	{
+		size_t next_first = (i + 1 < result->m_draw_batches.size()) ? result->m_draw_batches[i + 1].first : result->m_sprites.size();
+
+		result->m_draw_batches[i].count = next_first - result->m_draw_batches[i].first;
+	}
+
+	stage_timer.reset();
+
+	size_t animated_images = 0;
+
+	for (TextureHandle handle = 0; handle < result->m_texture_atlas.getItemsCount(); ++handle)
+	{
+		if (result->m_texture_atlas.getPosition(handle).frames > 1)
+		{
+			++animated_images;
+		}
+	}
+
+	result->m_statistics.setCounter("atlas_pages", result->m_texture_atlas.getPagesCount());
+	result->m_statistics.setCounter("atlas_fill_permille", std::lround(result->m_texture_atlas.getFillRatio() * 1000.0));
+	result->m_statistics.setCounter("atlas_items", result->m_texture_atlas.getItemsCount());
+	result->m_statistics.setCounter("draw_batches", result->m_draw_batches.size());
+	result->m_statistics.setCounter("map_chunks", chunks_x * chunks_y);
+	result->m_statistics.setCounter("map_levels", result->m_levels.size());
+	result->m_statistics.setCounter("loader_arena_bytes", loader_arena_upstream.getPeakBytes());
+	result->m_statistics.setCounter("ground_items", ground_items);
+	result->m_statistics.setCounter("ground_bytes", result->m_ground_tiles.size() + result->m_ground_items.size());
+	result->m_statistics.setCounter("animated_areas", result->m_animated_areas.size());
+	result->m_statistics.setCounter("texture_bytes", texture_bytes);
+	result->m_statistics.setCounter("palette_rows", result->m_palette_data.size() / palette_row_size);
+
+	// renderer wraps palette rows into columns of texture, rows which don't fit even then are drawn with colors of last row
+	const size_t palette_rows = result->m_palette_data.size() / palette_row_size;
+
+	if (palette_rows > static_cast<size_t>(m_max_texture_size))
+	{
+		const size_t max_palette_rows = static_cast<size_t>(m_max_texture_size) * std::max(m_max_texture_size / 256, 1);
+
+		qCWarning(homm3map_loader_log) << "Map" << map_name << "has" << palette_rows << "palette rows, more than maximum texture size" << m_max_texture_size;
+
+		if (palette_rows > max_palette_rows)
+		{
+			qCWarning(homm3map_loader_log) << "Palette rows don't fit into palette texture, some images of map" << map_name << "will have wrong colors";
+		}
+	}
+	result->m_statistics.setCounter("sprites", result->m_sprites.size());
+	result->m_statistics.setCounter("sprite_bytes", result->m_sprites.size() * sizeof(SpriteInstance));
+	result->m_statistics.setCounter("animated_images", animated_images);
+
+	Q_EMIT mapLoaded(result);
+}
+
+Homm3MapRenderer::Homm3MapRenderer()
 	: QQuickFramebufferObject::Renderer()
-	, m_texture_id(0)
-	, m_need_update_animation(false)
 	, m_need_update_map(false)
 {
-	QObject::connect(&m_frame_timer, &QTimer::timeout, this, &Homm3MapRenderer::updateFrames, Qt::QueuedConnection);
-
 	initialize();
-
-	m_frame_timer.start(std::chrono::milliseconds(frame_duration));
 }
 
 Homm3MapRenderer::~Homm3MapRenderer()
 {
-	if (m_texture_id)
+	releaseAtlasPages(m_shared_pages);
+	releaseAtlasPages(m_pending_shared_pages);
+
+	for (auto &pixel_buffer: m_pixel_buffers)
+	{
+		if (pixel_buffer.fence)
+		{
+			m_extra_functions->glDeleteSync(pixel_buffer.fence);
+		}
+
+		pixel_buffer.buffer.destroy();
+	}
+
+	if (m_direct_upload_fence)
+	{
+		m_extra_functions->glDeleteSync(m_direct_upload_fence);
+	}
+
+	if (m_palette_texture_id != 0)
+	{
+		glDeleteTextures(1, &m_palette_texture_id);
+	}
+
+	if (m_ground_tiles_texture_id != 0)
+	{
+		glDeleteTextures(1, &m_ground_tiles_texture_id);
+	}
+
+	if (m_ground_items_texture_id != 0)
 	{
-		glDeleteTextures(1, &m_texture_id);
+		glDeleteTextures(1, &m_ground_items_texture_id);
 	}
+
+	m_vertex_array.destroy();
+	m_ground_vertex_array.destroy();
+	m_quad_buffer.destroy();
+	m_sprite_buffer.destroy();
 }
 
 QOpenGLFramebufferObject* Homm3MapRenderer::createFramebufferObject(const QSize &size)
@@ -987,6 +1501,9 @@ QOpenGLFramebufferObject* Homm3MapRenderer::createFramebufferObject(const QSize
 	QOpenGLFramebufferObjectFormat format;
 	format.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
 
+	// new framebuffer has nothing from previous frames
+	m_need_full_redraw = true;
+
 	return new QOpenGLFramebufferObject(size, format);
 }
 
@@ -994,281 +1511,1481 @@ void Homm3MapRenderer::initialize()
 {
 	initializeOpenGLFunctions();
 
+	// instanced arrays are part of OpenGL 3.3 and OpenGL ES 3.0
+	auto context = QOpenGLContext::currentContext();
+	const auto context_format = context->format();
+
+	m_instancing = context->isOpenGLES() ? (context_format.majorVersion() >= 3) : (context_format.version() >= qMakePair(3, 3));
+
+	// mapping part of buffer and fences are part of OpenGL 3.2 and OpenGL ES 3.0
+	m_use_pixel_buffers = context->isOpenGLES() ? (context_format.majorVersion() >= 3) : (context_format.version() >= qMakePair(3, 2));
+
+	m_extra_functions = (m_instancing || m_use_pixel_buffers) ? context->extraFunctions() : nullptr;
+
+	// every sprite moves unit quad to its place on map and to its first frame in atlas,
+	// atlas keeps palette indices, palette animation selects one of consecutive palette rows,
+	// sprite animation moves texture coordinates to current frame in grid of frames
 	const char *vertex_source =
-		"attribute highp vec4 vertex;\n"
-		"attribute mediump vec2 tex_coord;\n"
+		"attribute highp vec2 corner;\n"
+		"attribute highp vec4 quad;\n"
+		"attribute highp vec4 texture_rect;\n"
+		"attribute highp vec4 animation;\n"
 		"uniform mediump mat4 matrix;\n"
+		"uniform highp vec2 page_size;\n"
+		"uniform highp float animation_frame;\n"
+		"uniform highp float palette_height;\n"
+		"uniform highp float palette_columns;\n"
 		"varying mediump vec2 tex_output;\n"
+		"varying highp vec3 palette_output;\n"
 		"\n"
 		"void main(void)\n"
 		"{\n"
-		"	gl_Position = matrix * vertex;\n"
-		"	tex_output = tex_coord;\n"
+		"	gl_Position = matrix * vec4(quad.xy + corner * quad.zw, 0.0, 1.0);\n"
+		"	highp float frame = floor(mod(animation_frame + 0.5, animation.x));\n"
+		"	highp float row = floor((frame + 0.5) / animation.y);\n"
+		"	tex_output = (texture_rect.xy + (vec2(frame - row * animation.y, row) + corner) * texture_rect.zw) / page_size;\n"
+		"	highp float palette_row = animation.z + floor(mod(animation_frame + 0.5, animation.w));\n"
+		"	highp float palette_line = floor((palette_row + 0.5) / palette_columns);\n"
+		"	highp float palette_width = 256.0 * palette_columns;\n"
+		"	palette_output = vec3(((palette_row - palette_line * palette_columns) * 256.0 + 0.5) / palette_width, (palette_line + 0.5) / palette_height, 1.0 / palette_width);\n"
 		"}\n";
 
+	// palette rows may be wrapped into several columns of palette texture, x of palette output is start of row and z is width of one color
 	const char *fragment_source =
+		"#if defined(GL_ES) && !defined(GL_FRAGMENT_PRECISION_HIGH)\n"
+		"#define highp mediump\n"
+		"#endif\n"
 		"varying mediump vec2 tex_output;\n"
-		"uniform sampler2D texture_item;"
+		"varying highp vec3 palette_output;\n"
+		"uniform sampler2D texture_item;\n"
+		"uniform sampler2D palette_texture;\n"
 		"\n"
 		"void main(void)\n"
 		"{\n"
-		"	gl_FragColor = texture2D(texture_item, tex_output);\n"
+		"	highp float index = texture2D(texture_item, tex_output).r * 255.0;\n"
+		"	gl_FragColor = texture2D(palette_texture, vec2(palette_output.x + index * palette_output.z, palette_output.y));\n"
 		"}\n";
 
 	m_program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vertex_source);
 	m_program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fragment_source);
 	m_program.link();
 
-	m_vertexAttr = m_program.attributeLocation("vertex");
-	m_textureAttr = m_program.attributeLocation("tex_coord");
-	m_matrixUniform = m_program.uniformLocation("matrix");
-	m_shaderTexture = m_program.uniformLocation("texture_item");
+	m_cornerAttr = m_program.attributeLocation("corner");
+	m_quadAttr = m_program.attributeLocation("quad");
+	m_textureAttr = m_program.attributeLocation("texture_rect");
+	m_animationAttr = m_program.attributeLocation("animation");
+	m_matrixUniform = m_program.uniformLocation("matrix");
+	m_shaderTexture = m_program.uniformLocation("texture_item");
+	m_pageSizeUniform = m_program.uniformLocation("page_size");
+	m_animationFrameUniform = m_program.uniformLocation("animation_frame");
+	m_paletteHeightUniform = m_program.uniformLocation("palette_height");
+	m_paletteColumnsUniform = m_program.uniformLocation("palette_columns");
+	m_shaderPalette = m_program.uniformLocation("palette_texture");
+
+	glUniform1i(m_shaderTexture, 0);
+
+	m_sprite_buffer.create();
+	m_sprite_buffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
+
+	// ground layers look up image of each tile in tiles texture, then its atlas position and palette in items texture,
+	// images are mirrored and clipped to their visible bounds here instead of in vertices
+	const char *ground_vertex_source =
+		"attribute highp vec2 vertex;\n"
+		"uniform mediump mat4 matrix;\n"
+		"uniform highp vec4 ground_rect;\n"
+		"uniform highp vec2 ground_origin;\n"
+		"varying highp vec2 layer_position;\n"
+		"\n"
+		"void main(void)\n"
+		"{\n"
+		"	highp vec2 position = ground_rect.xy + vertex * ground_rect.zw;\n"
+		"	gl_Position = matrix * vec4(position, 0.0, 1.0);\n"
+		"	layer_position = position - ground_origin;\n"
+		"}\n";
+
+	const char *ground_fragment_source =
+		"#if defined(GL_ES) && !defined(GL_FRAGMENT_PRECISION_HIGH)\n"
+		"#define highp mediump\n"
+		"#endif\n"
+		"varying highp vec2 layer_position;\n"
+		"uniform highp float tile_size;\n"
+		"uniform sampler2D ground_tiles;\n"
+		"uniform highp vec2 ground_tiles_size;\n"
+		"uniform highp float ground_layer_row;\n"
+		"uniform sampler2D ground_items;\n"
+		"uniform highp vec2 ground_items_size;\n"
+		"uniform sampler2D texture_item;\n"
+		"uniform highp float page;\n"
+		"uniform highp vec2 page_size;\n"
+		"uniform sampler2D palette_texture;\n"
+		"uniform highp float palette_height;\n"
+		"uniform highp float palette_columns;\n"
+		"uniform highp float animation_frame;\n"
+		"\n"
+		"highp vec4 getBytes(highp vec4 value)\n"
+		"{\n"
+		"	return floor(value * 255.0 + 0.5);\n"
+		"}\n"
+		"\n"
+		"highp vec4 getItemTexel(highp float index, highp float texel)\n"
+		"{\n"
+		"	return getBytes(texture2D(ground_items, (vec2(texel, index) + 0.5) / ground_items_size));\n"
+		"}\n"
+		"\n"
+		"void main(void)\n"
+		"{\n"
+		"	highp vec2 tile = floor(layer_position / tile_size);\n"
+		"	highp vec4 tile_data = getBytes(texture2D(ground_tiles, (tile + vec2(0.0, ground_layer_row) + 0.5) / ground_tiles_size));\n"
+		"	highp float index = tile_data.r + tile_data.g * 256.0 - 1.0;\n"
+		"	if (index < 0.0) discard;\n"
+		"	highp vec4 palette = getItemTexel(index, 1.0);\n"
+		"	if (abs(palette.w - page) > 0.5) discard;\n"
+		"	highp vec4 bounds = getItemTexel(index, 2.0);\n"
+		"	highp vec2 local = layer_position - tile * tile_size;\n"
+		"	if (mod(tile_data.b, 2.0) > 0.5) local.x = tile_size - local.x;\n"
+		"	if (tile_data.b > 1.5) local.y = tile_size - local.y;\n"
+		"	local -= bounds.xy;\n"
+		"	if (any(lessThan(local, vec2(0.0))) || any(greaterThanEqual(local, bounds.zw))) discard;\n"
+		"	highp vec4 position = getItemTexel(index, 0.0);\n"
+		"	highp vec2 atlas_position = position.xz + position.yw * 256.0 + local;\n"
+		"	highp float color_index = texture2D(texture_item, atlas_position / page_size).r * 255.0;\n"
+		"	highp float palette_row = palette.x + palette.y * 256.0 + floor(mod(animation_frame + 0.5, palette.z));\n"
+		"	highp float palette_line = floor((palette_row + 0.5) / palette_columns);\n"
+		"	highp float palette_x = (palette_row - palette_line * palette_columns) * 256.0 + color_index;\n"
+		"	gl_FragColor = texture2D(palette_texture, vec2((palette_x + 0.5) / (256.0 * palette_columns), (palette_line + 0.5) / palette_height));\n"
+		"}\n";
+
+	m_ground_program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, ground_vertex_source);
+	m_ground_program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, ground_fragment_source);
+	m_ground_program.link();
+
+	m_groundVertexAttr = m_ground_program.attributeLocation("vertex");
+	m_groundMatrixUniform = m_ground_program.uniformLocation("matrix");
+	m_groundRectUniform = m_ground_program.uniformLocation("ground_rect");
+	m_groundOriginUniform = m_ground_program.uniformLocation("ground_origin");
+	m_groundTileSizeUniform = m_ground_program.uniformLocation("tile_size");
+	m_groundTilesUniform = m_ground_program.uniformLocation("ground_tiles");
+	m_groundTilesSizeUniform = m_ground_program.uniformLocation("ground_tiles_size");
+	m_groundLayerRowUniform = m_ground_program.uniformLocation("ground_layer_row");
+	m_groundItemsUniform = m_ground_program.uniformLocation("ground_items");
+	m_groundItemsSizeUniform = m_ground_program.uniformLocation("ground_items_size");
+	m_groundTextureUniform = m_ground_program.uniformLocation("texture_item");
+	m_groundPageUniform = m_ground_program.uniformLocation("page");
+	m_groundPageSizeUniform = m_ground_program.uniformLocation("page_size");
+	m_groundPaletteUniform = m_ground_program.uniformLocation("palette_texture");
+	m_groundPaletteHeightUniform = m_ground_program.uniformLocation("palette_height");
+	m_groundPaletteColumnsUniform = m_ground_program.uniformLocation("palette_columns");
+	m_groundAnimationFrameUniform = m_ground_program.uniformLocation("animation_frame");
+
+	m_quad_buffer.create();
+	m_quad_buffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
+	m_quad_buffer.bind();
+	m_quad_buffer.allocate(quad_corners.data(), quad_corners.size() * sizeof(QVector2D));
+	QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+
+	// vertex array objects are optional in OpenGL ES 2, without them attributes are bound on every frame
+	if (m_vertex_array.create())
+	{
+		m_vertex_array.bind();
+		bindVertexAttributes();
+		m_vertex_array.release();
+	}
+
+	if (m_ground_vertex_array.create())
+	{
+		m_ground_vertex_array.bind();
+		bindGroundVertexAttributes();
+		m_ground_vertex_array.release();
+	}
+
+	// maps are loaded in background, loader needs to know how big atlas pages may be, so loading waits until this is known
+	GLint max_texture_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+
+	m_max_texture_size = (max_texture_size > 0) ? max_texture_size : Homm3MapSingleton::default_max_texture_size;
+
+	Homm3MapSingleton::getInstance()->setMaxTextureSize(m_max_texture_size);
+}
+
+void Homm3MapRenderer::render()
+{
+	QElapsedTimer frame_timer;
+	frame_timer.start();
+
+	prepareRenderData();
+
+	glDepthMask(true);
+	glDisable(GL_DEPTH_TEST);
+
+	// background of item is visible around maps smaller than view
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+	// camera is snapped to whole item pixels to keep tiles from bleeding into each other
+	const float scale = (m_scale > 0.0) ? m_scale : 1.0;
+	const float view_left = std::round(m_camera_x) / scale;
+	const float view_top = std::round(m_camera_y) / scale;
+
+	const QRectF view_rect(view_left, view_top, m_view_size.width() / scale, m_view_size.height() / scale);
+
+	QMatrix4x4 orthoview;
+	orthoview.ortho(view_rect.left(), view_rect.right(), view_rect.top(), view_rect.bottom(), -1, 1);
+
+	// palette is same for all pages and layers
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, m_palette_texture_id);
+	glActiveTexture(GL_TEXTURE0);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	size_t drawn_vertices = 0;
+	const auto framebuffer = framebufferObject();
+
+	if (m_need_full_redraw || (view_rect != m_drawn_view_rect) || (!framebuffer) || view_rect.isEmpty())
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		drawn_vertices += renderArea(orthoview, view_rect);
+	}
+	else
+	{
+		// rest of framebuffer still has last frame. Everything in animated area is drawn again in usual order,
+		// so objects in front of animated ones still cover them
+		const double pixels_x = framebuffer->width() / view_rect.width();
+		const double pixels_y = framebuffer->height() / view_rect.height();
+
+		glEnable(GL_SCISSOR_TEST);
+
+		for (size_t i = m_current_level.first_area; i < m_current_level.first_area + m_current_level.areas; ++i)
+		{
+			const QRectF area_rect = view_rect.intersected(QRectF(m_animated_areas[i]));
+
+			if (area_rect.isEmpty())
+			{
+				continue;
+			}
+
+			// bottom of framebuffer is top of view
+			const int left = std::floor((area_rect.left() - view_rect.left()) * pixels_x);
+			const int top = std::floor((area_rect.top() - view_rect.top()) * pixels_y);
+			const int right = std::ceil((area_rect.right() - view_rect.left()) * pixels_x);
+			const int bottom = std::ceil((area_rect.bottom() - view_rect.top()) * pixels_y);
+
+			glScissor(left, top, right - left, bottom - top);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			// whole cleared pixels have to be drawn again, even if area covers them only partially
+			const QRectF cleared_rect(view_rect.left() + left / pixels_x, view_rect.top() + top / pixels_y, (right - left) / pixels_x, (bottom - top) / pixels_y);
+
+			drawn_vertices += renderArea(orthoview, cleared_rect);
+		}
+
+		glDisable(GL_SCISSOR_TEST);
+	}
+
+	m_need_full_redraw = false;
+	m_drawn_view_rect = view_rect;
+
+	glDisable(GL_BLEND);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	glEnable(GL_DEPTH_TEST);
+
+	m_render_statistics.addFrame(frame_timer.nsecsElapsed(), drawn_vertices);
+}
+
+size_t Homm3MapRenderer::renderArea(const QMatrix4x4 &orthoview, const QRectF &area_rect)
+{
+	// terrain, rivers and roads are below everything else
+	renderGround(orthoview, area_rect);
+
+	m_program.bind();
+	m_program.setUniformValue(m_matrixUniform, orthoview);
+	m_program.setUniformValue(m_shaderTexture, 0);
+	m_program.setUniformValue(m_shaderPalette, 1);
+	m_program.setUniformValue(m_animationFrameUniform, static_cast<GLfloat>(m_animation_frame));
+	m_program.setUniformValue(m_paletteHeightUniform, static_cast<GLfloat>(m_palette_height));
+	m_program.setUniformValue(m_paletteColumnsUniform, static_cast<GLfloat>(m_palette_columns));
+
+	if (m_vertex_array.isCreated())
+	{
+		m_vertex_array.bind();
+	}
+	else
+	{
+		bindVertexAttributes();
+	}
+
+	// batches are kept in drawing order, so switching pages doesn't change overlapping of images.
+	// Batches outside of area are skipped, and neighbouring drawn batches of same page are drawn together
+	size_t drawn_vertices = 0;
+	DrawBatch pending_batch;
+
+	auto draw_batch_func = [this, &drawn_vertices](const DrawBatch &batch) {
+		if (batch.count == 0)
+		{
+			return;
+		}
+
+		const auto page_size = m_texture_atlas.getPageSize(batch.page);
+
+		m_program.setUniformValue(m_pageSizeUniform, QVector2D(page_size.width(), page_size.height()));
+
+		glBindTexture(GL_TEXTURE_2D, m_texture_ids[batch.page]);
+
+		if (m_instancing)
+		{
+			bindSpriteAttributes(batch.first);
+			m_extra_functions->glDrawArraysInstanced(GL_TRIANGLES, 0, quad_corners.size(), batch.count);
+		}
+		else
+		{
+			glDrawArrays(GL_TRIANGLES, batch.first * quad_corners.size(), batch.count * quad_corners.size());
+		}
+
+		drawn_vertices += batch.count * quad_corners.size();
+	};
+
+	const auto first_batch = m_draw_batches.begin() + m_current_level.first_batch;
+
+	for (auto iter = first_batch; iter != first_batch + m_current_level.batches; ++iter)
+	{
+		if ((iter->page >= m_texture_ids.size()) || (!area_rect.intersects(QRectF(iter->bounds))))
+		{
+			continue;
+		}
+
+		if ((pending_batch.count != 0) && (pending_batch.page == iter->page) && (pending_batch.first + pending_batch.count == iter->first))
+		{
+			pending_batch.count += iter->count;
+			continue;
+		}
+
+		draw_batch_func(pending_batch);
+
+		pending_batch = *iter;
+	}
+
+	draw_batch_func(pending_batch);
+
+	if (m_vertex_array.isCreated())
+	{
+		m_vertex_array.release();
+	}
+	else
+	{
+		// without vertex array object divisors are global state, which is shared with scene graph
+		if (m_instancing)
+		{
+			m_extra_functions->glVertexAttribDivisor(m_quadAttr, 0);
+			m_extra_functions->glVertexAttribDivisor(m_textureAttr, 0);
+			m_extra_functions->glVertexAttribDivisor(m_animationAttr, 0);
+		}
+
+		m_program.disableAttributeArray(m_cornerAttr);
+		m_program.disableAttributeArray(m_quadAttr);
+		m_program.disableAttributeArray(m_textureAttr);
+		m_program.disableAttributeArray(m_animationAttr);
+	}
+
+	m_program.release();
+
+	return drawn_vertices;
+}
+
+void Homm3MapRenderer::prepareRenderData()
+{
+	if (m_need_update_map && m_pending_map)
+	{
+		startUpload();
+	}
+
+	m_need_update_map = false;
+
+	if (!m_upload_pending)
+	{
+		return;
+	}
+
+	QElapsedTimer upload_timer;
+	upload_timer.start();
+
+	auto singleton = Homm3MapSingleton::getInstance();
+	size_t upload_page = m_pending_shared_pages.size();
+	bool complete = true;
+
+	const auto page_ready = [this](const SharedAtlasPage *page) {
+		return page->complete && (page->finished || (page->completed_by == this));
+	};
+
+	{
+		std::lock_guard<std::mutex> shared_pages_lock(singleton->shared_atlas_pages_mutex);
+
+		for (size_t page = 0; page < m_pending_shared_pages.size(); ++page)
+		{
+			auto shared_page = m_pending_shared_pages[page];
+
+			if (page_ready(shared_page))
+			{
+				continue;
+			}
+
+			complete = false;
+
+			// other context didn't wait for GPU when it completed page, so page is sent again from this one
+			if (shared_page->complete)
+			{
+				shared_page->complete = false;
+			}
+
+			// renderer which started upload of page is gone, so this one continues it
+			if (!shared_page->uploader)
+			{
+				shared_page->uploader = this;
+				shared_page->source = m_pending_map;
+				shared_page->source_page = page;
+			}
+
+			// page which is partially uploaded already is finished first
+			if ((shared_page->uploader == this) && ((upload_page == m_pending_shared_pages.size()) || (page == m_upload_page)))
+			{
+				upload_page = page;
+			}
+			else if ((shared_page->uploader != this) && (std::find(shared_page->waiting_renderers.begin(), shared_page->waiting_renderers.end(), this) == shared_page->waiting_renderers.end()))
+			{
+				shared_page->waiting_renderers.push_back(this);
+			}
+		}
+	}
+
+	if (upload_page != m_upload_page)
+	{
+		m_upload_page = upload_page;
+		m_upload_row = 0;
+	}
+
+	// only one slice is uploaded per frame, so scene graph is never blocked for long
+	if ((m_upload_page < m_pending_shared_pages.size()) && uploadTextureSlice() && uploadFinished())
+	{
+		std::lock_guard<std::mutex> shared_pages_lock(singleton->shared_atlas_pages_mutex);
+
+		auto shared_page = m_pending_shared_pages[m_upload_page];
+
+		shared_page->complete = true;
+		shared_page->uploader = nullptr;
+		shared_page->completed_by = this;
+		shared_page->finished = !m_upload_unfinished;
+		m_upload_unfinished = false;
+
+		// waiting renderers don't render until page they wait for is complete
+		for (auto renderer: shared_page->waiting_renderers)
+		{
+			renderer->update();
+		}
+
+		shared_page->waiting_renderers.clear();
+
+		complete = std::all_of(m_pending_shared_pages.begin(), m_pending_shared_pages.end(), page_ready);
+	}
+
+	m_upload_elapsed += upload_timer.nsecsElapsed();
+
+	if (complete)
+	{
+		finishUpload();
+	}
+	else if (m_upload_page < m_pending_shared_pages.size())
+	{
+		// render again without waiting for item to change
+		update();
+	}
+}
+
+void Homm3MapRenderer::startUpload()
+{
+	// pages of map which wasn't completely uploaded yet are dropped
+	releaseAtlasPages(m_pending_shared_pages);
+
+	m_upload_start_rss = LoadStatistics::getResidentMemory();
+
+	QElapsedTimer upload_timer;
+	upload_timer.start();
+
+	auto singleton = Homm3MapSingleton::getInstance();
+	auto share_group = QOpenGLContext::currentContext()->shareGroup();
+
+	std::lock_guard<std::mutex> shared_pages_lock(singleton->shared_atlas_pages_mutex);
+
+	m_pending_shared_pages.reserve(m_pending_map->m_texture_data.size());
+
+	for (size_t page = 0; page < m_pending_map->m_texture_data.size(); ++page)
+	{
+		const auto page_size = m_pending_map->m_texture_atlas.getPageSize(page);
+		const uint64_t page_hash = m_pending_map->m_page_hashes[page];
+
+		const auto &page_data = m_pending_map->m_texture_data[page];
+
+		// same page may already be in shared context, usually from renderer of other screen showing same map,
+		// it's reused only while map it was uploaded from is kept by some renderer and its pixels are equal
+		auto page_iter = std::find_if(singleton->shared_atlas_pages.begin(), singleton->shared_atlas_pages.end(), [share_group, page_hash, page_size, &page_data](const SharedAtlasPage &item) {
+			if ((item.share_group != share_group) || (item.hash != page_hash) || (item.size != page_size))
+			{
+				return false;
+			}
+
+			auto source = item.source.lock();
+
+			return source && (source->m_texture_data[item.source_page].size() == page_data.size())
+				&& (memcmp(source->m_texture_data[item.source_page].data(), page_data.data(), page_data.size()) == 0);
+		});
+
+		if (page_iter == singleton->shared_atlas_pages.end())
+		{
+			SharedAtlasPage shared_page;
+			shared_page.share_group = share_group;
+			shared_page.hash = page_hash;
+			shared_page.size = page_size;
+			shared_page.source = m_pending_map;
+			shared_page.source_page = page;
+			shared_page.uploader = this;
+
+			glGenTextures(1, &shared_page.texture_id);
+
+			// storage of page is only allocated here, pixels are added slice by slice,
+			// indices must never be interpolated, so filtering is always nearest
+			glBindTexture(GL_TEXTURE_2D, shared_page.texture_id);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, page_size.width(), page_size.height(), 0,  GL_LUMINANCE, GL_UNSIGNED_BYTE, nullptr);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+			// page size is not power of two, such textures can't be repeated
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+			page_iter = singleton->shared_atlas_pages.insert(singleton->shared_atlas_pages.end(), shared_page);
+		}
+
+		++(page_iter->users);
+		m_pending_shared_pages.push_back(&(*page_iter));
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	m_upload_pending = true;
+	m_upload_page = 0;
+	m_upload_row = 0;
+	m_upload_unfinished = false;
+	m_upload_elapsed = upload_timer.nsecsElapsed();
+}
+
+void Homm3MapRenderer::releaseAtlasPages(std::vector<SharedAtlasPage*> &pages)
+{
+	if (pages.empty())
+	{
+		return;
+	}
+
+	auto singleton = Homm3MapSingleton::getInstance();
+
+	std::lock_guard<std::mutex> shared_pages_lock(singleton->shared_atlas_pages_mutex);
+
+	for (auto page: pages)
+	{
+		page->waiting_renderers.erase(std::remove(page->waiting_renderers.begin(), page->waiting_renderers.end(), this), page->waiting_renderers.end());
+
+		// one of waiting renderers continues upload
+		if (page->uploader == this)
+		{
+			page->uploader = nullptr;
+
+			for (auto renderer: page->waiting_renderers)
+			{
+				renderer->update();
+			}
+
+			page->waiting_renderers.clear();
+		}
+
+		if (page->completed_by == this)
+		{
+			page->completed_by = nullptr;
+		}
+
+		// pages which no map uses anymore are removed from GPU
+		if (--(page->users) == 0)
+		{
+			glDeleteTextures(1, &(page->texture_id));
+
+			singleton->shared_atlas_pages.remove_if([page](const SharedAtlasPage &item) { return &item == page; });
+		}
+	}
+
+	pages.clear();
+}
+
+bool Homm3MapRenderer::uploadTextureSlice()
+{
+	const auto page_size = m_pending_map->m_texture_atlas.getPageSize(m_upload_page);
+
+	// all rows are sent already, GPU may still be reading them
+	if (m_upload_row >= page_size.height())
+	{
+		return true;
+	}
+
+	const int rows = std::clamp<int>(upload_slice_size / std::max(page_size.width(), 1), 1, page_size.height() - m_upload_row);
+	const size_t slice_size = static_cast<size_t>(rows) * page_size.width();
+	const uint8_t *slice = m_pending_map->m_texture_data[m_upload_page].data() + static_cast<size_t>(m_upload_row) * page_size.width();
+
+	bool uploaded = false;
+
+	glBindTexture(GL_TEXTURE_2D, m_pending_shared_pages[m_upload_page]->texture_id);
+
+	// rows of single byte pages are not aligned to 4 bytes
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	if (m_use_pixel_buffers)
+	{
+		auto &pixel_buffer = m_pixel_buffers[m_next_pixel_buffer];
+
+		// if GPU still reads previous slice from this buffer, try again on next frame instead of waiting
+		if (pixel_buffer.fence)
+		{
+			if (m_extra_functions->glClientWaitSync(pixel_buffer.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			{
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+				glBindTexture(GL_TEXTURE_2D, 0);
+				return false;
+			}
+
+			m_extra_functions->glDeleteSync(pixel_buffer.fence);
+			pixel_buffer.fence = nullptr;
+		}
+
+		if (!pixel_buffer.buffer.isCreated())
+		{
+			pixel_buffer.buffer.create();
+			pixel_buffer.buffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
+			pixel_buffer.buffer.bind();
+			pixel_buffer.buffer.allocate(upload_slice_size);
+		}
+		else
+		{
+			pixel_buffer.buffer.bind();
+		}
+
+		// previous contents of buffer are discarded, so mapping doesn't wait for GPU
+		void *buffer_data = pixel_buffer.buffer.mapRange(0, slice_size, QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer);
+
+		if (buffer_data)
+		{
+			memcpy(buffer_data, slice, slice_size);
+			pixel_buffer.buffer.unmap();
+
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m_upload_row, page_size.width(), rows, GL_LUMINANCE, GL_UNSIGNED_BYTE, nullptr);
+
+			pixel_buffer.fence = m_extra_functions->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			m_next_pixel_buffer = (m_next_pixel_buffer + 1) % m_pixel_buffers.size();
+
+			uploaded = true;
+		}
+
+		QOpenGLBuffer::release(QOpenGLBuffer::PixelUnpackBuffer);
+	}
+
+	if (!uploaded)
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m_upload_row, page_size.width(), rows, GL_LUMINANCE, GL_UNSIGNED_BYTE, slice);
+		m_direct_upload_pending = true;
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	m_upload_row += rows;
+
+	return (m_upload_row >= page_size.height());
+}
+
+bool Homm3MapRenderer::uploadFinished()
+{
+	// page is used by other contexts once it's complete, so they must not see it before GPU has executed all commands uploading it
+	if (m_direct_upload_pending)
+	{
+		m_direct_upload_pending = false;
+
+		if (m_use_pixel_buffers)
+		{
+			m_direct_upload_fence = m_extra_functions->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+		}
+		else
+		{
+			auto singleton = Homm3MapSingleton::getInstance();
+			bool shared = false;
+
+			{
+				std::lock_guard<std::mutex> shared_pages_lock(singleton->shared_atlas_pages_mutex);
+				shared = (m_pending_shared_pages[m_upload_page]->users > 1);
+			}
+
+			// without sync objects there is no way to check it later, so GPU is waited for only if other contexts use page,
+			// if one joins it later, it uploads page again itself
+			if (shared)
+			{
+				glFinish();
+			}
+			else
+			{
+				glFlush();
+				m_upload_unfinished = true;
+			}
+		}
+	}
+
+	if (m_direct_upload_fence)
+	{
+		if (m_extra_functions->glClientWaitSync(m_direct_upload_fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			return false;
+		}
+
+		m_extra_functions->glDeleteSync(m_direct_upload_fence);
+		m_direct_upload_fence = nullptr;
+	}
+
+	// new pages are used only when GPU has read all slices, so drawing never waits for upload
+	for (auto &pixel_buffer: m_pixel_buffers)
+	{
+		if (!pixel_buffer.fence)
+		{
+			continue;
+		}
+
+		if (m_extra_functions->glClientWaitSync(pixel_buffer.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			return false;
+		}
+
+		m_extra_functions->glDeleteSync(pixel_buffer.fence);
+		pixel_buffer.fence = nullptr;
+	}
+
+	return true;
+}
+
+void Homm3MapRenderer::finishUpload()
+{
+	QElapsedTimer upload_timer;
+	upload_timer.start();
+
+	// previous map is replaced only now
+	releaseAtlasPages(m_shared_pages);
+
+	m_shared_pages = std::move(m_pending_shared_pages);
+	m_pending_shared_pages.clear();
+
+	m_texture_ids.clear();
+
+	for (auto page: m_shared_pages)
+	{
+		m_texture_ids.push_back(page->texture_id);
+	}
+
+	// prepared map is shared with other map items, so only parts needed for drawing are copied
+	const MapData &map_data = *m_pending_map;
+
+	m_map = map_data.m_map;
+	m_texture_atlas = map_data.m_texture_atlas;
+	m_draw_batches = map_data.m_draw_batches;
+	m_ground_pages = map_data.m_ground_pages;
+	m_animated_areas = map_data.m_animated_areas;
+	m_levels = map_data.m_levels;
+
+	selectLevel(m_pending_map_level);
+
+	m_animation_cycle = map_data.m_animation_cycle;
+	m_animation_frame %= m_animation_cycle;
+
+	// sprites are needed only by GPU
+	m_sprite_buffer.bind();
+
+	if (m_instancing)
+	{
+		m_sprite_buffer.allocate(map_data.m_sprites.data(), map_data.m_sprites.size() * sizeof(SpriteInstance));
+	}
+	else
+	{
+		std::vector<SpriteVertex> sprite_vertices;
+		sprite_vertices.reserve(map_data.m_sprites.size() * quad_corners.size());
+
+		for (const auto &sprite: map_data.m_sprites)
+		{
+			for (const auto &corner: quad_corners)
+			{
+				sprite_vertices.push_back(SpriteVertex { sprite, { corner.x(), corner.y() } });
+			}
+		}
+
+		m_sprite_buffer.allocate(sprite_vertices.data(), sprite_vertices.size() * sizeof(SpriteVertex));
+	}
+
+	QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+
+	if (m_palette_texture_id == 0)
+	{
+		glGenTextures(1, &m_palette_texture_id);
+	}
+
+	if (m_ground_tiles_texture_id == 0)
+	{
+		glGenTextures(1, &m_ground_tiles_texture_id);
+	}
+
+	if (m_ground_items_texture_id == 0)
+	{
+		glGenTextures(1, &m_ground_items_texture_id);
+	}
+
+	// values are read exactly by shader, so they are never filtered.
+	// Missing texels are zero, they are added to copy of data which is shared with other renderers
+	auto upload_data_texture_func = [this](GLuint texture_id, const QSize &texture_size, const std::vector<uint8_t> &texture_data) {
+		const size_t texture_bytes = static_cast<size_t>(texture_size.width()) * texture_size.height() * 4;
+		const uint8_t *pixels = texture_data.data();
+		std::vector<uint8_t> padded_data;
+
+		if (texture_data.size() < texture_bytes)
+		{
+			padded_data = texture_data;
+			padded_data.resize(texture_bytes, 0);
+			pixels = padded_data.data();
+		}
+
+		glBindTexture(GL_TEXTURE_2D, texture_id);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_size.width(), texture_size.height(), 0,  GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	};
+
+	// rows of palette are wrapped into several columns, if there are more of them than texture may be high,
+	// wrapped texture has same layout of data, so it's only padded to whole lines
+	const int palette_rows = std::max<int>(map_data.m_palette_data.size() / (256 * 4), 1);
+
+	m_palette_columns = std::clamp((palette_rows + m_max_texture_size - 1) / m_max_texture_size, 1, std::max(m_max_texture_size / 256, 1));
+	m_palette_height = std::min((palette_rows + m_palette_columns - 1) / m_palette_columns, m_max_texture_size);
+
+	upload_data_texture_func(m_palette_texture_id, QSize(256 * m_palette_columns, m_palette_height), map_data.m_palette_data);
+
+	// every layer of every level takes one row of texels per row of tiles
+	m_ground_tiles_size = QSize(getMapWidth(m_map), getMapHeight(m_map) * ground_layers * std::max<int>(m_levels.size(), 1));
+	m_ground_items_size = QSize(ground_item_texels, std::max<int>(map_data.m_ground_items.size() / (ground_item_texels * 4), 1));
+
+	upload_data_texture_func(m_ground_tiles_texture_id, m_ground_tiles_size, map_data.m_ground_tiles);
+	upload_data_texture_func(m_ground_items_texture_id, m_ground_items_size, map_data.m_ground_items);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// prepared map is released once all renderers showing it have uploaded it
+	m_pending_map.reset();
+
+	m_upload_pending = false;
+	m_need_full_redraw = true;
+
+	m_upload_elapsed += upload_timer.nsecsElapsed();
+
+	Q_EMIT textureUploaded(m_upload_elapsed, LoadStatistics::getResidentMemory() - m_upload_start_rss);
+}
+
+void Homm3MapRenderer::bindVertexAttributes()
+{
+	m_program.enableAttributeArray(m_cornerAttr);
+	m_program.enableAttributeArray(m_quadAttr);
+	m_program.enableAttributeArray(m_textureAttr);
+	m_program.enableAttributeArray(m_animationAttr);
+
+	if (m_instancing)
+	{
+		// all instances share same quad
+		m_quad_buffer.bind();
+		m_program.setAttributeBuffer(m_cornerAttr, GL_FLOAT, 0, 2);
+
+		m_extra_functions->glVertexAttribDivisor(m_quadAttr, 1);
+		m_extra_functions->glVertexAttribDivisor(m_textureAttr, 1);
+		m_extra_functions->glVertexAttribDivisor(m_animationAttr, 1);
+	}
+	else
+	{
+		m_sprite_buffer.bind();
+		m_program.setAttributeBuffer(m_cornerAttr, GL_FLOAT, offsetof(SpriteVertex, corner), 2, sizeof(SpriteVertex));
+	}
+
+	bindSpriteAttributes(0);
+}
+
+void Homm3MapRenderer::bindSpriteAttributes(size_t first)
+{
+	// instanced draw calls can't start from given instance, so attributes are moved to first sprite of batch instead
+	const size_t stride = m_instancing ? sizeof(SpriteInstance) : sizeof(SpriteVertex);
+	const uintptr_t offset = first * stride;
+
+	// values are pixels, they must not be normalized
+	m_sprite_buffer.bind();
+	glVertexAttribPointer(m_quadAttr, 4, GL_SHORT, GL_FALSE, stride, reinterpret_cast<const void*>(offset + offsetof(SpriteInstance, left)));
+	glVertexAttribPointer(m_textureAttr, 4, GL_UNSIGNED_SHORT, GL_FALSE, stride, reinterpret_cast<const void*>(offset + offsetof(SpriteInstance, texture_x)));
+	glVertexAttribPointer(m_animationAttr, 4, GL_UNSIGNED_SHORT, GL_FALSE, stride, reinterpret_cast<const void*>(offset + offsetof(SpriteInstance, frames)));
+
+	QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+}
+
+void Homm3MapRenderer::bindGroundVertexAttributes()
+{
+	m_ground_program.enableAttributeArray(m_groundVertexAttr);
+
+	m_quad_buffer.bind();
+	m_ground_program.setAttributeBuffer(m_groundVertexAttr, GL_FLOAT, 0, 2);
+
+	QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+}
+
+void Homm3MapRenderer::renderGround(const QMatrix4x4 &orthoview, const QRectF &area_rect)
+{
+	if (m_ground_pages.empty() || (m_ground_tiles_texture_id == 0) || (m_ground_items_texture_id == 0))
+	{
+		return;
+	}
+
+	m_ground_program.bind();
+	m_ground_program.setUniformValue(m_groundMatrixUniform, orthoview);
+	m_ground_program.setUniformValue(m_groundTileSizeUniform, static_cast<GLfloat>(tile_size));
+	m_ground_program.setUniformValue(m_groundTextureUniform, 0);
+	m_ground_program.setUniformValue(m_groundPaletteUniform, 1);
+	m_ground_program.setUniformValue(m_groundTilesUniform, 2);
+	m_ground_program.setUniformValue(m_groundItemsUniform, 3);
+	m_ground_program.setUniformValue(m_groundTilesSizeUniform, QVector2D(m_ground_tiles_size.width(), m_ground_tiles_size.height()));
+	m_ground_program.setUniformValue(m_groundItemsSizeUniform, QVector2D(m_ground_items_size.width(), m_ground_items_size.height()));
+	m_ground_program.setUniformValue(m_groundPaletteHeightUniform, static_cast<GLfloat>(m_palette_height));
+	m_ground_program.setUniformValue(m_groundPaletteColumnsUniform, static_cast<GLfloat>(m_palette_columns));
+	m_ground_program.setUniformValue(m_groundAnimationFrameUniform, static_cast<GLfloat>(m_animation_frame));
+
+	if (m_ground_vertex_array.isCreated())
+	{
+		m_ground_vertex_array.bind();
+	}
+	else
+	{
+		bindGroundVertexAttributes();
+	}
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, m_ground_tiles_texture_id);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, m_ground_items_texture_id);
+	glActiveTexture(GL_TEXTURE0);
+
+	for (int layer = 0; layer < ground_layers; ++layer)
+	{
+		const QPoint layer_origin = getGroundLayerOrigin(layer);
+
+		// fragments are only processed for drawn part of layer
+		const QRectF layer_rect(layer_origin.x(), layer_origin.y(), getMapWidth(m_map) * tile_size, getMapHeight(m_map) * tile_size);
+		const QRectF ground_rect = layer_rect.intersected(area_rect);
+
+		if (ground_rect.isEmpty())
+		{
+			continue;
+		}
+
+		m_ground_program.setUniformValue(m_groundRectUniform, QVector4D(ground_rect.x(), ground_rect.y(), ground_rect.width(), ground_rect.height()));
+		m_ground_program.setUniformValue(m_groundOriginUniform, QVector2D(layer_origin.x(), layer_origin.y()));
+		m_ground_program.setUniformValue(m_groundLayerRowUniform, static_cast<GLfloat>((m_level_index * ground_layers + layer) * getMapHeight(m_map)));
+
+		// layers of later pages are drawn after same layer of earlier pages, tiles don't overlap inside of layer
+		for (size_t page: m_ground_pages)
+		{
+			if (page >= m_texture_ids.size())
+			{
+				continue;
+			}
+
+			const auto page_size = m_texture_atlas.getPageSize(page);
+
+			m_ground_program.setUniformValue(m_groundPageUniform, static_cast<GLfloat>(page));
+			m_ground_program.setUniformValue(m_groundPageSizeUniform, QVector2D(page_size.width(), page_size.height()));
+
+			glBindTexture(GL_TEXTURE_2D, m_texture_ids[page]);
+			glDrawArrays(GL_TRIANGLES, 0, 6);
+		}
+	}
+
+	if (m_ground_vertex_array.isCreated())
+	{
+		m_ground_vertex_array.release();
+	}
+	else
+	{
+		m_ground_program.disableAttributeArray(m_groundVertexAttr);
+	}
+
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	m_ground_program.release();
+}
+
+void Homm3MapRenderer::selectLevel(int level)
+{
+	size_t level_index = 0;
+
+	// levels which are not prepared are never shown, first prepared one is shown instead
+	for (size_t i = 0; i < m_levels.size(); ++i)
+	{
+		if (m_levels[i].level == level)
+		{
+			level_index = i;
+			break;
+		}
+	}
+
+	if (level_index != m_level_index)
+	{
+		m_need_full_redraw = true;
+	}
+
+	m_level_index = level_index;
+	m_current_level = (level_index < m_levels.size()) ? m_levels[level_index] : MapLevel();
+}
+
+void Homm3MapRenderer::synchronize(QQuickFramebufferObject *item)
+{
+	auto map_item = static_cast<Homm3Map*>(item);
+
+	QObject::connect(this, &Homm3MapRenderer::textureUploaded, map_item, &Homm3Map::textureUploaded, static_cast<Qt::ConnectionType>(Qt::QueuedConnection | Qt::UniqueConnection));
+
+	QMutexLocker guard(&(map_item->m_data_mutex));
+
+	// item is also updated for animation and camera changes, map data is only taken when new map is loaded
+	m_animation_frame = map_item->m_animation_frame;
+
+	m_scale = map_item->m_scale;
+	m_camera_x = map_item->m_camera_x;
+	m_camera_y = map_item->m_camera_y;
+	m_view_size = QSizeF(map_item->width(), map_item->height());
+
+	// level of item belongs to its latest map, which may still be uploaded
+	if (map_item->m_map_data_changed || m_pending_map)
+	{
+		m_pending_map_level = map_item->m_map_level;
+	}
+	else
+	{
+		selectLevel(map_item->m_map_level);
+	}
+
+	if (!map_item->m_map_data_changed)
+	{
+		m_animation_frame %= m_animation_cycle;
+		return;
+	}
+
+	map_item->m_map_data_changed = false;
+	m_need_update_map = true;
+
+	// until new map is uploaded, previous one stays on screen
+	m_pending_map = std::move(map_item->m_map_data);
+	map_item->m_map_data.reset();
+
+	m_animation_frame %= m_animation_cycle;
+}
+
+Homm3Map::Homm3Map(QQuickItem *parent)
+	: QQuickFramebufferObject(parent)
+	, m_scale(1.0)
+	, m_camera_x(0.0)
+	, m_camera_y(0.0)
+	, m_animation_enabled(true)
+	, m_max_animation_rate(0.0)
+	, m_pause_when_obscured(true)
+	, m_animation_frame(0)
+	, m_prepare_all_levels(false)
+	, m_map_level(0)
+{
+	m_frame_timer.setTimerType(Qt::CoarseTimer);
+	QObject::connect(&m_frame_timer, &QTimer::timeout, this, &Homm3Map::updateFrames);
+	QObject::connect(this, &QQuickItem::windowChanged, this, &Homm3Map::updateAnimationTimer);
+
+}
+
+Homm3Map::~Homm3Map()
+{
+}
+
+QQuickFramebufferObject::Renderer* Homm3Map::createRenderer() const
+{
+	return new Homm3MapRenderer();
+}
+
+void Homm3Map::loadMap(const QString &filename, int level)
+{
+	requestMapData(filename, std::shared_ptr<CMap>(), level);
+}
 
-	glUniform1i(m_shaderTexture, 0);
+void Homm3Map::requestMapData(const QString &map_name, std::shared_ptr<CMap> map, int level)
+{
+	QPointer<Homm3Map> map_item(this);
 
-	glGenTextures(1, &m_texture_id);
+	// result comes from worker thread, it's passed to item through event loop of application,
+	// which lives longer than item
+	Homm3MapSingleton::getInstance()->requestMapData(map_name, map, m_prepare_all_levels ? all_map_levels : level, [map_item, level](std::shared_ptr<const MapData> data) {
+		QMetaObject::invokeMethod(QCoreApplication::instance(), [map_item, data, level]() {
+			if (map_item)
+			{
+				map_item->mapLoaded(data, level);
+			}
+		}, Qt::QueuedConnection);
+	});
 }
 
-void Homm3MapRenderer::render()
+void Homm3Map::toggleLevel()
 {
-	prepareRenderData();
+	QString map_name;
+	int map_level = 0;
 
-	if (m_need_update_animation)
 	{
-		m_need_update_animation = false;
-
-		updateAnimatedItems();
-	}
-
-	glDepthMask(true);
-	glDisable(GL_DEPTH_TEST);
+		QMutexLocker guard(&m_data_mutex);
 
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if ((!m_map) || (!m_map->twoLevel))
+		{
+			return;
+		}
 
-	QMatrix4x4 orthoview;
-	orthoview.ortho(0, (getMapWidth(m_map) + 2) * tile_size, 0, (getMapHeight(m_map) + 2) * tile_size, -1, 1);
+		if (!m_all_levels_prepared)
+		{
+			// map read from cache has only its header, so it's loaded again for other level
+			requestMapData(m_current_map, m_map_tiles_loaded ? m_map : std::shared_ptr<CMap>(), 1 - m_map_level);
+			return;
+		}
 
-	m_program.bind();
-	m_program.setUniformValue(m_matrixUniform, orthoview);
+		// renderer already has both levels, it only draws the other one
+		m_map_level = 1 - m_map_level;
 
-	m_program.enableAttributeArray(m_vertexAttr);
-	m_program.enableAttributeArray(m_textureAttr);
+		map_name = m_current_map;
+		map_level = m_map_level;
+	}
 
-	m_program.setAttributeArray(m_vertexAttr, m_vertices.data());
-	m_program.setAttributeArray(m_textureAttr, m_texcoords.data());
-	glBindTexture(GL_TEXTURE_2D, m_texture_id);
+	update();
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	Q_EMIT loadingFinished(map_name, map_level);
+}
 
-	glDrawArrays(GL_TRIANGLES, 0, m_vertices.size());
+void Homm3Map::setDataArchives(const QStringList &files)
+{
+	Homm3MapSingleton::getInstance()->setDataArchives(files);
+}
 
-	glDisable(GL_BLEND);
-	m_program.disableAttributeArray(m_vertexAttr);
-	m_program.disableAttributeArray(m_textureAttr);
-	glBindTexture(GL_TEXTURE_2D, 0);
+bool Homm3Map::isMapLoaded() const
+{
+	QMutexLocker guard(&m_data_mutex);
 
-	m_program.release();
+	return static_cast<bool>(m_map);
+}
 
-	glEnable(GL_DEPTH_TEST);
+QString Homm3Map::currentMapName() const
+{
+	QMutexLocker guard(&m_data_mutex);
 
-	update();
+	return m_current_map;
 }
 
-void Homm3MapRenderer::prepareRenderData()
+int Homm3Map::mapLevel() const
 {
-	if (m_need_update_map && !m_texture_data.empty())
-	{
-		glBindTexture(GL_TEXTURE_2D, m_texture_id);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_texture_atlas.getSize(), m_texture_atlas.getSize(), 0,  GL_RGBA, GL_UNSIGNED_BYTE, m_texture_data.data());
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glFinish();
-		glBindTexture(GL_TEXTURE_2D, 0);
+	QMutexLocker guard(&m_data_mutex);
 
-		m_texture_data.clear();
-	}
+	return m_map_level;
+}
 
-	m_need_update_map = false;
+double Homm3Map::scale() const
+{
+	return m_scale;
 }
 
-void Homm3MapRenderer::updateFrames()
+void Homm3Map::setScale(double value)
 {
-	for (auto iter = m_current_frames.begin(); iter != m_current_frames.end(); ++iter)
+	// if m_scale == value, return
+	if (std::nextafter(m_scale, std::numeric_limits<double>::lowest()) <= value
+		&& std::nextafter(m_scale, std::numeric_limits<double>::max()) >= value)
 	{
-		iter->second = (iter->second + 1) % iter->first;
+		return;
 	}
 
-	m_need_update_animation = true;
+	m_scale = value;
+
+	Q_EMIT scaleUpdated(m_scale);
+	Q_EMIT contentSizeUpdated();
+
+	update();
 }
 
-void Homm3MapRenderer::synchronize(QQuickFramebufferObject *item)
+double Homm3Map::cameraX() const
 {
-	auto map_item = static_cast<Homm3Map*>(item);
+	return m_camera_x;
+}
 
-	m_need_update_map = true;
+void Homm3Map::setCameraX(double value)
+{
+	// if m_camera_x == value, return
+	if (std::nextafter(m_camera_x, std::numeric_limits<double>::lowest()) <= value
+		&& std::nextafter(m_camera_x, std::numeric_limits<double>::max()) >= value)
+	{
+		return;
+	}
 
-	QMutexLocker guard(&(map_item->m_data_mutex));
+	m_camera_x = value;
 
-	m_map = map_item->m_map;
+	Q_EMIT cameraXUpdated(m_camera_x);
 
-	m_vertices = std::move(map_item->m_vertices);
-	m_texcoords = std::move(map_item->m_texcoords);
+	update();
+}
 
-	m_texture_atlas = std::move(map_item->m_texture_atlas);
+double Homm3Map::cameraY() const
+{
+	return m_camera_y;
+}
 
-	m_current_frames = std::move(map_item->m_current_frames);
+void Homm3Map::setCameraY(double value)
+{
+	// if m_camera_y == value, return
+	if (std::nextafter(m_camera_y, std::numeric_limits<double>::lowest()) <= value
+		&& std::nextafter(m_camera_y, std::numeric_limits<double>::max()) >= value)
+	{
+		return;
+	}
 
-	m_animated_items = std::move(map_item->m_animated_items);
+	m_camera_y = value;
 
-	m_texture_data = std::move(map_item->m_texture_data);
+	Q_EMIT cameraYUpdated(m_camera_y);
 
-	map_item->m_vertices.clear();
-	map_item->m_texcoords.clear();
-	map_item->m_texture_atlas.clear();
-	map_item->m_current_frames.clear();
-	map_item->m_animated_items.clear();
-	map_item->m_texture_data.clear();
+	update();
 }
 
-void Homm3MapRenderer::updateAnimatedItems()
+double Homm3Map::contentWidth() const
 {
-	const auto atlas_size = m_texture_atlas.getSize();
+	QMutexLocker guard(&m_data_mutex);
 
-	for (auto iter = m_animated_items.begin(); iter != m_animated_items.end(); ++iter)
+	if (!m_map)
 	{
-		if (iter->first.is_terrain)
-		{
-			auto tex_rect = m_texture_atlas.findItem(TextureItem(iter->first.name, 0, iter->first.group, m_current_frames[iter->first.total_frames]));
-
-			for (auto state_iter = iter->second.begin(); state_iter != iter->second.end(); ++state_iter)
-			{
-				for (auto coord_iter = state_iter->second.begin(); coord_iter != state_iter->second.end(); ++coord_iter)
-				{
-					m_texcoords[(*coord_iter)    ] = QVector2D(static_cast<float>(tex_rect.x() + ((state_iter->first % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((state_iter->first / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size));
-					m_texcoords[(*coord_iter) + 1] = QVector2D(static_cast<float>(tex_rect.x() + ((state_iter->first % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((state_iter->first / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size));
-					m_texcoords[(*coord_iter) + 2] = QVector2D(static_cast<float>(tex_rect.x() + ((state_iter->first % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((state_iter->first / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size));
-					m_texcoords[(*coord_iter) + 3] = QVector2D(static_cast<float>(tex_rect.x() + ((state_iter->first % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((state_iter->first / 2 == 0) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size));
-					m_texcoords[(*coord_iter) + 4] = QVector2D(static_cast<float>(tex_rect.x() + ((state_iter->first % 2 == 0) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((state_iter->first / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size));
-					m_texcoords[(*coord_iter) + 5] = QVector2D(static_cast<float>(tex_rect.x() + ((state_iter->first % 2 == 1) ? 0 : tex_rect.width())) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + ((state_iter->first / 2 == 1) ? 0 : tex_rect.height())) / static_cast<float>(atlas_size));
-				}
-			}
-		}
-		else
-		{
-			auto tex_rect = m_texture_atlas.findItem(TextureItem(iter->first.name, iter->first.group, m_current_frames[iter->first.total_frames], iter->first.special));
-
-			for (auto coord_iter = iter->second[0].begin(); coord_iter != iter->second[0].end(); ++coord_iter)
-			{
-				m_texcoords[(*coord_iter)    ] = QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size));
-				m_texcoords[(*coord_iter) + 1] = QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size));
-				m_texcoords[(*coord_iter) + 2] = QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size));
-				m_texcoords[(*coord_iter) + 3] = QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y())                     / static_cast<float>(atlas_size));
-				m_texcoords[(*coord_iter) + 4] = QVector2D(static_cast<float>(tex_rect.x())                    / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size));
-				m_texcoords[(*coord_iter) + 5] = QVector2D(static_cast<float>(tex_rect.x() + tex_rect.width()) / static_cast<float>(atlas_size), static_cast<float>(tex_rect.y() + tex_rect.height()) / static_cast<float>(atlas_size));
-			}
-		}
+		return 0;
 	}
+
+	return (getMapWidth(m_map) + 2) * tile_size * m_scale;
 }
 
-Homm3Map::Homm3Map(QQuickItem *parent)
-	: QQuickFramebufferObject(parent)
-	, m_scale(1.0)
-	, m_map_level(0)
+double Homm3Map::contentHeight() const
 {
-	Homm3MapLoader *map_loader = new Homm3MapLoader;
-	map_loader->moveToThread(&m_worker_thread);
+	QMutexLocker guard(&m_data_mutex);
 
-	QObject::connect(&m_worker_thread, &QThread::finished, map_loader, &QObject::deleteLater);
-	QObject::connect(this, &Homm3Map::startLoadingMap, map_loader, &Homm3MapLoader::loadMapData, Qt::QueuedConnection);
-	QObject::connect(map_loader, &Homm3MapLoader::mapLoaded, this, &Homm3Map::mapLoaded, Qt::QueuedConnection);
+	if (!m_map)
+	{
+		return 0;
+	}
 
-	m_worker_thread.start();
+	return (getMapHeight(m_map) + 2) * tile_size * m_scale;
 }
 
-Homm3Map::~Homm3Map()
+bool Homm3Map::animationEnabled() const
 {
-	m_worker_thread.quit();
-	m_worker_thread.wait();
+	return m_animation_enabled;
 }
 
-QQuickFramebufferObject::Renderer* Homm3Map::createRenderer() const
+void Homm3Map::setAnimationEnabled(bool value)
 {
-	return new Homm3MapRenderer();
+	if (m_animation_enabled == value)
+	{
+		return;
+	}
+
+	m_animation_enabled = value;
+
+	Q_EMIT animationEnabledUpdated(m_animation_enabled);
+
+	updateAnimationTimer();
 }
 
-void Homm3Map::loadMap(const QString &filename, int level)
+double Homm3Map::maxAnimationRate() const
 {
-	Q_EMIT startLoadingMap(filename, std::shared_ptr<CMap>(), level);
+	return m_max_animation_rate;
 }
 
-void Homm3Map::toggleLevel()
+void Homm3Map::setMaxAnimationRate(double value)
 {
-	QMutexLocker guard(&m_data_mutex);
+	value = std::max(value, 0.0);
 
-	if ((!m_map) || (!m_map->twoLevel))
+	// if m_max_animation_rate == value, return
+	if (std::nextafter(m_max_animation_rate, std::numeric_limits<double>::lowest()) <= value
+		&& std::nextafter(m_max_animation_rate, std::numeric_limits<double>::max()) >= value)
 	{
 		return;
 	}
 
-	Q_EMIT startLoadingMap(m_current_map, m_map, 1 - m_map_level);
+	m_max_animation_rate = value;
+
+	Q_EMIT maxAnimationRateUpdated(m_max_animation_rate);
+
+	updateAnimationTimer();
 }
 
-void Homm3Map::setDataArchives(const QStringList &files)
+bool Homm3Map::pauseWhenObscured() const
 {
-	Homm3MapSingleton::getInstance()->setDataArchives(files);
+	return m_pause_when_obscured;
 }
 
-bool Homm3Map::isMapLoaded() const
+void Homm3Map::setPauseWhenObscured(bool value)
 {
-	QMutexLocker guard(&m_data_mutex);
+	if (m_pause_when_obscured == value)
+	{
+		return;
+	}
 
-	return static_cast<bool>(m_map);
+	m_pause_when_obscured = value;
+
+	Q_EMIT pauseWhenObscuredUpdated(m_pause_when_obscured);
+
+	updateAnimationTimer();
 }
 
-QString Homm3Map::currentMapName() const
+bool Homm3Map::prepareAllLevels() const
 {
-	QMutexLocker guard(&m_data_mutex);
-
-	return m_current_map;
+	return m_prepare_all_levels;
 }
 
-int Homm3Map::mapLevel() const
+void Homm3Map::setPrepareAllLevels(bool value)
 {
-	QMutexLocker guard(&m_data_mutex);
+	if (m_prepare_all_levels == value)
+	{
+		return;
+	}
 
-	return m_map_level;
+	m_prepare_all_levels = value;
+
+	Q_EMIT prepareAllLevelsUpdated(m_prepare_all_levels);
 }
 
-double Homm3Map::scale() const
+void Homm3Map::updateFrames()
 {
-	return m_scale;
+	// game animation speed is kept when timer fires less often or irregularly, some frames are just skipped.
+	// Step is rounded to nearest frame, so timer firing slightly early doesn't drop a frame
+	const qint64 elapsed = m_animation_clock.restart() + m_animation_remainder;
+	const qint64 step = (elapsed + frame_duration / 2) / frame_duration;
+
+	m_animation_remainder = elapsed - step * frame_duration;
+
+	if (step <= 0)
+	{
+		return;
+	}
+
+	{
+		QMutexLocker guard(&m_data_mutex);
+
+		if (m_animation_cycle <= 1)
+		{
+			return;
+		}
+
+		// shader selects frames of all animations
+		m_animation_frame = (m_animation_frame + step) % m_animation_cycle;
+	}
+
+	// image only changes when animation frame changes, so it's redrawn only then
+	update();
 }
 
-void Homm3Map::setScale(double value)
+void Homm3Map::updateAnimationTimer()
 {
-	// if m_scale == value, return
-	if (std::nextafter(m_scale, std::numeric_limits<double>::lowest()) <= value
-		&& std::nextafter(m_scale, std::numeric_limits<double>::max()) >= value)
+	if (m_window != window())
 	{
+		if (m_window)
+		{
+			m_window->removeEventFilter(this);
+			QObject::disconnect(m_window, nullptr, this, nullptr);
+		}
+
+		m_window = window();
+
+		if (m_window)
+		{
+			m_window->installEventFilter(this);
+			QObject::connect(m_window, &QWindow::visibilityChanged, this, &Homm3Map::updateAnimationTimer);
+		}
+	}
+
+	bool active = m_animation_enabled && isVisible() && m_window;
+
+	if (active && m_pause_when_obscured)
+	{
+		active = m_window->isExposed()
+			&& (m_window->visibility() != QWindow::Hidden)
+			&& (m_window->visibility() != QWindow::Minimized);
+	}
+
+	if (!active)
+	{
+		// nothing is rendered while timer is stopped
+		m_frame_timer.stop();
 		return;
 	}
 
-	QMutexLocker guard(&m_data_mutex);
+	int interval = frame_duration;
 
-	m_scale = value;
+	if (m_max_animation_rate > 0.0)
+	{
+		interval = std::max<int>(interval, std::lround(1000.0 / m_max_animation_rate));
+	}
 
-	Q_EMIT scaleUpdated(m_scale);
+	// time while animation was stopped is not played
+	if (!m_frame_timer.isActive())
+	{
+		m_animation_clock.start();
+		m_animation_remainder = 0;
+	}
+
+	if ((!m_frame_timer.isActive()) || (m_frame_timer.interval() != interval))
+	{
+		m_frame_timer.start(interval);
+	}
+}
 
-	if (m_map)
+void Homm3Map::itemChange(QQuickItem::ItemChange change, const QQuickItem::ItemChangeData &value)
+{
+	QQuickFramebufferObject::itemChange(change, value);
+
+	// window changes are handled by windowChanged signal
+	if (change == QQuickItem::ItemVisibleHasChanged)
+	{
+		updateAnimationTimer();
+	}
+}
+
+bool Homm3Map::eventFilter(QObject *watched, QEvent *event)
+{
+	if ((watched == m_window) && ((event->type() == QEvent::Expose) || (event->type() == QEvent::Show) || (event->type() == QEvent::Hide)))
 	{
-		setWidth((getMapWidth(m_map) + 2) * tile_size * m_scale);
-		setHeight((getMapHeight(m_map) + 2) * tile_size * m_scale);
+		// window isn't exposed yet while handling expose event
+		QMetaObject::invokeMethod(this, &Homm3Map::updateAnimationTimer, Qt::QueuedConnection);
 	}
+
+	return QQuickFramebufferObject::eventFilter(watched, event);
 }
 
-void Homm3Map::mapLoaded(std::shared_ptr<MapData> data)
+void Homm3Map::mapLoaded(std::shared_ptr<const MapData> data, int level)
 {
 	QString map_name;
 	int map_level = 0;
@@ -1276,28 +2993,33 @@ void Homm3Map::mapLoaded(std::shared_ptr<MapData> data)
 	{
 		QMutexLocker guard(&m_data_mutex);
 
-		if ((!data) || data->m_vertices.empty() || data->m_texcoords.empty() || data->m_texture_data.empty())
+		if ((!data) || data->m_sprites.empty() || data->m_texture_data.empty())
 		{
 			return;
 		}
 
-		m_map = std::move(data->m_map);
-		m_current_map = std::move(data->m_name);
-		m_map_level = std::move(data->m_level);
+		m_map = data->m_map;
+		m_map_tiles_loaded = data->m_map_tiles_loaded;
+		m_current_map = data->m_name;
+		m_map_level = data->m_level;
+		m_all_levels_prepared = (data->m_levels.size() > 1);
 
-		m_vertices = std::move(data->m_vertices);
-		m_texcoords = std::move(data->m_texcoords);
-
-		m_texture_atlas = std::move(data->m_texture_atlas);
-
-		m_current_frames = std::move(data->m_current_frames);
+		// when all levels are prepared, requested one is shown
+		for (const auto &map_level: data->m_levels)
+		{
+			if (map_level.level == level)
+			{
+				m_map_level = level;
+			}
+		}
 
-		m_animated_items = std::move(data->m_animated_items);
+		m_map_data = data;
 
-		m_texture_data = std::move(data->m_texture_data);
+		m_animation_cycle = data->m_animation_cycle;
+		m_animation_frame %= m_animation_cycle;
+		m_map_data_changed = true;
 
-		setWidth((getMapWidth(m_map) + 2) * tile_size * m_scale);
-		setHeight((getMapHeight(m_map) + 2) * tile_size * m_scale);
+		m_load_statistics = data->m_statistics;
 
 		map_name = m_current_map;
 		map_level = m_map_level;
@@ -1305,5 +3027,71 @@ void Homm3Map::mapLoaded(std::shared_ptr<MapData> data)
 
 	update();
 
+	Q_EMIT contentSizeUpdated();
+
+	publishLoadStatistics();
+
 	Q_EMIT loadingFinished(map_name, map_level);
 }
+
+void Homm3Map::textureUploaded(qint64 elapsed_ns, qint64 rss_delta)
+{
+	{
+		QMutexLocker guard(&m_data_mutex);
+
+		m_load_statistics.addStage(LoadStage::gl_upload, elapsed_ns, rss_delta);
+	}
+
+	publishLoadStatistics();
+}
+
+QVariantMap Homm3Map::loadStatistics() const
+{
+	QMutexLocker guard(&m_data_mutex);
+
+	QVariantMap result = m_load_statistics.toVariantMap();
+
+	result[QStringLiteral("map")] = m_current_map;
+	result[QStringLiteral("level")] = m_map_level;
+
+	return result;
+}
+
+QString Homm3Map::loadStatisticsFile() const
+{
+	return m_load_statistics_file;
+}
+
+void Homm3Map::setLoadStatisticsFile(const QString &value)
+{
+	if (m_load_statistics_file == value)
+	{
+		return;
+	}
+
+	m_load_statistics_file = value;
+
+	Q_EMIT loadStatisticsFileUpdated(m_load_statistics_file);
+}
+
+void Homm3Map::publishLoadStatistics()
+{
+	{
+		QMutexLocker guard(&m_data_mutex);
+
+		m_load_statistics.log(m_current_map, m_map_level);
+	}
+
+	if (!m_load_statistics_file.isEmpty())
+	{
+		QSaveFile statistics_file(m_load_statistics_file);
+
+		if (statistics_file.open(QIODevice::WriteOnly))
+		{
+			statistics_file.write(QJsonDocument(QJsonObject::fromVariantMap(loadStatistics())).toJson());
+			statistics_file.commit();
+		}
+	}
+
+	Q_EMIT loadStatisticsUpdated();
+}
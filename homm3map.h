@@ -8,56 +8,140 @@
 
 #pragma once
 
+#include <stdint.h>
+
+#include <array>
 #include <memory>
-#include <set>
 #include <tuple>
+#include <vector>
 
 #include <QtCore/QFuture>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QFutureWatcher>
 #include <QtCore/QMetaType>
 #include <QtCore/QMutex>
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QRect>
+#include <QtCore/QRectF>
+#include <QtCore/QSizeF>
 #include <QtCore/QStringList>
-#include <QtCore/QThread>
 #include <QtCore/QTimer>
+#include <QtCore/QVariantMap>
+#include <QtGui/QMatrix4x4>
+#include <QtGui/QOpenGLExtraFunctions>
 #include <QtGui/QOpenGLFunctions>
+#include <QtGui/QVector2D>
+#include <QtGui/QVector4D>
+#include <QtOpenGL/QOpenGLBuffer>
 #include <QtOpenGL/QOpenGLShaderProgram>
+#include <QtOpenGL/QOpenGLVertexArrayObject>
 #include <QtQuick/QQuickFramebufferObject>
+#include <QtQuick/QQuickWindow>
 
 #include "vcmi/CMap.h"
 
 #include "globals.h"
+#include "load_statistics.h"
 #include "texture_atlas.h"
 
 class Homm3MapRenderer;
+struct DataArchives;
+struct SharedAtlasPage;
+
+// one object or border image, drawn by moving shared unit quad, all values are in pixels
+struct SpriteInstance
+{
+	// position of visible part of image on map
+	int16_t left = 0;
+	int16_t top = 0;
+	int16_t width = 0;
+	int16_t height = 0;
+
+	// position of first frame in atlas page
+	uint16_t texture_x = 0;
+	uint16_t texture_y = 0;
+	uint16_t texture_width = 0;
+	uint16_t texture_height = 0;
+
+	// frames are placed in grid of given count of columns, palette animation takes consecutive palette rows
+	uint16_t frames = 1;
+	uint16_t columns = 1;
+	uint16_t palette_first = 0;
+	uint16_t palette_rows = 1;
+};
+
+// consecutive sprites of one chunk of map drawn with same atlas page
+struct DrawBatch
+{
+	size_t page = 0;
+	size_t first = 0;
+	size_t count = 0;
+
+	// area covered by all quads of batch, in map pixels
+	QRect bounds;
+};
+
+// level passed to loader to prepare all levels of map together
+const int all_map_levels = -1;
 
-struct AnimatedItem
+// prepared level of map, its batches and animated areas are ranges of those of map data
+struct MapLevel
 {
-	std::string name;
-	int group = 0;
-	int special = -1;
-	size_t total_frames = 1;
-	bool is_terrain = false;
+	int level = 0;
 
-	bool operator<(const AnimatedItem &other) const;
+	size_t first_batch = 0;
+	size_t batches = 0;
+	size_t first_area = 0;
+	size_t areas = 0;
 };
 
 struct MapData
 {
 	std::shared_ptr<CMap> m_map;
+
+	// map read from cache has only its header
+	bool m_map_tiles_loaded = true;
+
 	QString m_name;
 	int m_level = 0;
 
-	std::vector<QVector3D> m_vertices;
-	std::vector<QVector2D> m_texcoords;
+	// prepared levels share atlas, palettes and ground items, their sprites, batches,
+	// ground tiles and animated areas follow each other in order of levels
+	std::vector<MapLevel> m_levels;
+
+	std::vector<SpriteInstance> m_sprites;
 
 	TextureAtlas m_texture_atlas;
 
-	std::map<size_t, size_t> m_current_frames;
+	std::vector<DrawBatch> m_draw_batches;
+
+	// one image of palette indices per atlas page
+	std::vector<std::vector<uint8_t> > m_texture_data;
+
+	// equal pages of different maps have equal hashes, such pages are uploaded only once
+	std::vector<uint64_t> m_page_hashes;
 
-	std::map<AnimatedItem, std::map<int, std::set<size_t> > > m_animated_items;
+	// palette rows of 256 colors each, animated palettes take several consecutive rows
+	std::vector<uint8_t> m_palette_data;
 
-	std::vector<uint8_t> m_texture_data;
+	// terrain, rivers and roads are drawn by shader from one texel per tile of each layer,
+	// texel holds index of ground item plus one and mirroring of its image
+	std::vector<uint8_t> m_ground_tiles;
+
+	// atlas position, palette rows and visible bounds of every ground item
+	std::vector<uint8_t> m_ground_items;
+
+	// atlas pages used by ground items
+	std::vector<size_t> m_ground_pages;
+
+	// parts of map in map pixels which change between animation frames
+	std::vector<QRect> m_animated_areas;
+
+	// all sprite and palette animations repeat after this count of frames
+	size_t m_animation_cycle = 1;
+
+	LoadStatistics m_statistics;
 };
 
 class Homm3MapLoader: public QObject
@@ -65,13 +149,19 @@ class Homm3MapLoader: public QObject
 	Q_OBJECT
 
 public:
-	explicit Homm3MapLoader(QObject *parent = nullptr);
+	// images are read from given archives even if singleton switches to other ones meanwhile
+	// atlas pages are never bigger than max_texture_size
+	Homm3MapLoader(std::shared_ptr<const DataArchives> archives, int max_texture_size, QObject *parent = nullptr);
 
 Q_SIGNALS:
 	void mapLoaded(std::shared_ptr<MapData> data);
 
 public Q_SLOTS:
 	void loadMapData(QString map_name, std::shared_ptr<CMap> map, int level);
+
+private:
+	std::shared_ptr<const DataArchives> m_archives;
+	int m_max_texture_size;
 };
 
 class Homm3Map: public QQuickFramebufferObject
@@ -79,6 +169,16 @@ class Homm3Map: public QQuickFramebufferObject
 	Q_OBJECT
 
 	Q_PROPERTY(double scale READ scale WRITE setScale NOTIFY scaleUpdated);
+	Q_PROPERTY(double cameraX READ cameraX WRITE setCameraX NOTIFY cameraXUpdated);
+	Q_PROPERTY(double cameraY READ cameraY WRITE setCameraY NOTIFY cameraYUpdated);
+	Q_PROPERTY(double contentWidth READ contentWidth NOTIFY contentSizeUpdated);
+	Q_PROPERTY(double contentHeight READ contentHeight NOTIFY contentSizeUpdated);
+	Q_PROPERTY(bool animationEnabled READ animationEnabled WRITE setAnimationEnabled NOTIFY animationEnabledUpdated);
+	Q_PROPERTY(double maxAnimationRate READ maxAnimationRate WRITE setMaxAnimationRate NOTIFY maxAnimationRateUpdated);
+	Q_PROPERTY(bool pauseWhenObscured READ pauseWhenObscured WRITE setPauseWhenObscured NOTIFY pauseWhenObscuredUpdated);
+	Q_PROPERTY(bool prepareAllLevels READ prepareAllLevels WRITE setPrepareAllLevels NOTIFY prepareAllLevelsUpdated);
+	Q_PROPERTY(QVariantMap loadStatistics READ loadStatistics NOTIFY loadStatisticsUpdated);
+	Q_PROPERTY(QString loadStatisticsFile READ loadStatisticsFile WRITE setLoadStatisticsFile NOTIFY loadStatisticsFileUpdated);
 
 public:
 	explicit Homm3Map(QQuickItem *parent = nullptr);
@@ -96,35 +196,103 @@ public:
 	double scale() const;
 	void setScale(double value);
 
+	// position of top left corner of item on scaled map, may be negative to center small maps
+	double cameraX() const;
+	void setCameraX(double value);
+
+	double cameraY() const;
+	void setCameraY(double value);
+
+	// size of whole scaled map including its borders
+	double contentWidth() const;
+	double contentHeight() const;
+
+	bool animationEnabled() const;
+	void setAnimationEnabled(bool value);
+
+	// frames per second, 0 means no limit
+	double maxAnimationRate() const;
+	void setMaxAnimationRate(double value);
+
+	bool pauseWhenObscured() const;
+	void setPauseWhenObscured(bool value);
+
+	// all levels of map are prepared together, so toggling level only switches drawn level,
+	// it takes effect when next map is loaded
+	bool prepareAllLevels() const;
+	void setPrepareAllLevels(bool value);
+
+	QVariantMap loadStatistics() const;
+
+	QString loadStatisticsFile() const;
+	void setLoadStatisticsFile(const QString &value);
+
 Q_SIGNALS:
 	void loadingFinished(QString map_name, int level);
 	void scaleUpdated(double);
-	void startLoadingMap(QString map_name, std::shared_ptr<CMap> map, int level);
+	void cameraXUpdated(double);
+	void cameraYUpdated(double);
+	void contentSizeUpdated();
+	void animationEnabledUpdated(bool);
+	void maxAnimationRateUpdated(double);
+	void pauseWhenObscuredUpdated(bool);
+	void prepareAllLevelsUpdated(bool);
+	void loadStatisticsUpdated();
+	void loadStatisticsFileUpdated(QString);
 
 private Q_SLOTS:
-	void mapLoaded(std::shared_ptr<MapData> data);
+	void mapLoaded(std::shared_ptr<const MapData> data, int level);
+	void textureUploaded(qint64 elapsed_ns, qint64 rss_delta);
+	void updateFrames();
+	void updateAnimationTimer();
 
-private:
-	QThread m_worker_thread;
+protected:
+	virtual void itemChange(QQuickItem::ItemChange change, const QQuickItem::ItemChangeData &value) override;
+	virtual bool eventFilter(QObject *watched, QEvent *event) override;
 
+private:
 	double m_scale;
+	double m_camera_x;
+	double m_camera_y;
+
+	// animation runs only while it can be seen, renderer draws new frame only when animation frame changes
+	QTimer m_frame_timer;
+
+	// frames follow time elapsed since last frame, part of frame duration which wasn't shown yet is kept for next frame
+	QElapsedTimer m_animation_clock;
+	qint64 m_animation_remainder = 0;
+
+	QPointer<QQuickWindow> m_window;
+	bool m_animation_enabled;
+	double m_max_animation_rate;
+	bool m_pause_when_obscured;
+	size_t m_animation_frame;
+	bool m_prepare_all_levels;
 
 	mutable QMutex m_data_mutex;
 
 	std::shared_ptr<CMap> m_map;
+	bool m_map_tiles_loaded = false;
 	QString m_current_map;
 	int m_map_level;
 
-	std::vector<QVector3D> m_vertices;
-	std::vector<QVector2D> m_texcoords;
+	// other level of map is shown without loading it again
+	bool m_all_levels_prepared = false;
 
-	TextureAtlas m_texture_atlas;
+	// prepared map is shared with other map items showing same map, renderer only reads it
+	std::shared_ptr<const MapData> m_map_data;
+
+	// all sprite and palette animations repeat after this count of frames
+	size_t m_animation_cycle = 1;
 
-	std::map<size_t, size_t> m_current_frames;
+	// set when new map is loaded and it wasn't taken by renderer yet
+	bool m_map_data_changed = false;
 
-	std::map<AnimatedItem, std::map<int, std::set<size_t> > > m_animated_items;
+	LoadStatistics m_load_statistics;
+	QString m_load_statistics_file;
 
-	std::vector<uint8_t> m_texture_data;
+	void requestMapData(const QString &map_name, std::shared_ptr<CMap> map, int level);
+	void publishLoadStatistics();
 
 	friend class Homm3MapRenderer;
 };
@@ -144,40 +312,147 @@ public:
 	virtual void render() override;
 
 	void prepareRenderData();
+	void bindVertexAttributes();
+	void bindSpriteAttributes(size_t first);
+	void bindGroundVertexAttributes();
+	void startUpload();
+	void releaseAtlasPages(std::vector<SharedAtlasPage*> &pages);
+	bool uploadTextureSlice();
+	bool uploadFinished();
+	void finishUpload();
+	size_t renderArea(const QMatrix4x4 &orthoview, const QRectF &area_rect);
+	void renderGround(const QMatrix4x4 &orthoview, const QRectF &area_rect);
+	void selectLevel(int level);
 
-private Q_SLOTS:
-	void updateFrames();
+Q_SIGNALS:
+	void textureUploaded(qint64 elapsed_ns, qint64 rss_delta);
 
 protected:
 	virtual void synchronize(QQuickFramebufferObject *item) override;
 
 private:
 	QOpenGLShaderProgram m_program;
-	int m_vertexAttr = 0;
+	int m_cornerAttr = 0;
+	int m_quadAttr = 0;
 	int m_textureAttr = 0;
 	int m_matrixUniform = 0;
 	int m_shaderTexture = 0;
-	GLuint m_texture_id = 0;
+	int m_pageSizeUniform = 0;
+	int m_animationAttr = 0;
+	int m_animationFrameUniform = 0;
+	int m_paletteHeightUniform = 0;
+	int m_paletteColumnsUniform = 0;
+	int m_shaderPalette = 0;
+
+	QOpenGLShaderProgram m_ground_program;
+	int m_groundVertexAttr = 0;
+	int m_groundMatrixUniform = 0;
+	int m_groundRectUniform = 0;
+	int m_groundOriginUniform = 0;
+	int m_groundTileSizeUniform = 0;
+	int m_groundTilesUniform = 0;
+	int m_groundTilesSizeUniform = 0;
+	int m_groundLayerRowUniform = 0;
+	int m_groundItemsUniform = 0;
+	int m_groundItemsSizeUniform = 0;
+	int m_groundTextureUniform = 0;
+	int m_groundPageUniform = 0;
+	int m_groundPageSizeUniform = 0;
+	int m_groundPaletteUniform = 0;
+	int m_groundPaletteHeightUniform = 0;
+	int m_groundPaletteColumnsUniform = 0;
+	int m_groundAnimationFrameUniform = 0;
+
+	std::vector<GLuint> m_texture_ids;
+	GLuint m_palette_texture_id = 0;
+	int m_palette_height = 1;
+	int m_palette_columns = 1;
+	int m_max_texture_size = 0;
+	size_t m_animation_frame = 0;
+
+	GLuint m_ground_tiles_texture_id = 0;
+	GLuint m_ground_items_texture_id = 0;
+	QSize m_ground_tiles_size;
+	QSize m_ground_items_size;
+
+	// framebuffer has size of item, only part of map under camera is drawn into it
+	double m_scale = 1.0;
+	double m_camera_x = 0.0;
+	double m_camera_y = 0.0;
+	QSizeF m_view_size;
+
+	// framebuffer keeps last frame, if only animation frame changed since then, just animated areas are redrawn
+	bool m_need_full_redraw = true;
+	QRectF m_drawn_view_rect;
+
+	// sprites never change after upload, animation only changes frame uniform
+	QOpenGLVertexArrayObject m_vertex_array;
+	QOpenGLBuffer m_sprite_buffer;
+
+	// without instancing every sprite is repeated for each vertex of its quad together with its corner
+	QOpenGLExtraFunctions *m_extra_functions = nullptr;
+	bool m_instancing = false;
+
+	// ground layers are single quads, they only move this unit square
+	QOpenGLVertexArrayObject m_ground_vertex_array;
+	QOpenGLBuffer m_quad_buffer;
+
+	RenderStatistics m_render_statistics;
 
 	std::shared_ptr<CMap> m_map;
 
-	std::vector<QVector3D> m_vertices;
-	std::vector<QVector2D> m_texcoords;
-
 	TextureAtlas m_texture_atlas;
 
-	std::map<size_t, size_t> m_current_frames;
+	std::vector<DrawBatch> m_draw_batches;
 
-	std::map<AnimatedItem, std::map<int, std::set<size_t> > > m_animated_items;
+	// atlas pages used by ground items
+	std::vector<size_t> m_ground_pages;
 
-	std::vector<uint8_t> m_texture_data;
+	// parts of map in map pixels which change between animation frames
+	std::vector<QRect> m_animated_areas;
 
-	QTimer m_frame_timer;
-	bool m_need_update_animation;
-	bool m_need_update_map;
+	// only batches and animated areas of shown level are drawn, its ground tiles start at its first layer
+	std::vector<MapLevel> m_levels;
+	MapLevel m_current_level;
+	size_t m_level_index = 0;
+
+	// all sprite and palette animations repeat after this count of frames
+	size_t m_animation_cycle = 1;
+
+	// atlas pages are shared with renderers of other screens and with maps shown later
+	std::vector<SharedAtlasPage*> m_shared_pages;
 
-	void updateAnimatedItems();
+	// new map is uploaded in slices over several frames, previous map is drawn until all pages of new one are complete
+	std::shared_ptr<const MapData> m_pending_map;
+	std::vector<SharedAtlasPage*> m_pending_shared_pages;
+	int m_pending_map_level = 0;
+	bool m_upload_pending = false;
+	size_t m_upload_page = 0;
+	int m_upload_row = 0;
+	int64_t m_upload_elapsed = 0;
+	int64_t m_upload_start_rss = 0;
+
+	// slices are copied into pixel buffers, fence of each buffer tells when GPU has read its slice
+	struct PixelBuffer
+	{
+		QOpenGLBuffer buffer = QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+		GLsync fence = nullptr;
+	};
+
+	std::array<PixelBuffer, 2> m_pixel_buffers;
+	size_t m_next_pixel_buffer = 0;
+	bool m_use_pixel_buffers = false;
+
+	// slices uploaded directly from memory are fenced only when page is finished
+	bool m_direct_upload_pending = false;
+	GLsync m_direct_upload_fence = nullptr;
+
+	// without sync objects page is only flushed, unless other renderers use it too
+	bool m_upload_unfinished = false;
+
+	bool m_need_update_map;
 };
 
 Q_DECLARE_METATYPE(std::shared_ptr<MapData>);
+Q_DECLARE_METATYPE(std::shared_ptr<const MapData>);
 Q_DECLARE_METATYPE(std::shared_ptr<CMap>);
@@ -13,7 +13,9 @@
 #include "vcmi/CBinaryReader.h"
 #include "vcmi/CFileInputStream.h"
 
+#include "homm3map.h"
 #include "lod_archive.h"
+#include "map_cache.h"
 
 std::shared_ptr<Homm3MapSingleton> Homm3MapSingleton::s_instance;
 std::mutex Homm3MapSingleton::s_instance_mutex;
@@ -25,6 +27,9 @@ std::shared_ptr<Homm3MapSingleton> Homm3MapSingleton::getInstance()
 	if (!s_instance)
 	{
 		s_instance = std::shared_ptr<Homm3MapSingleton>(new Homm3MapSingleton);
+
+		// loading takes a lot of memory, so only two maps are loaded at once
+		s_instance->m_worker_pool.setMaxThreadCount(2);
 	}
 
 	return s_instance;
@@ -32,7 +37,7 @@ std::shared_ptr<Homm3MapSingleton> Homm3MapSingleton::getInstance()
 
 void Homm3MapSingleton::setDataArchives(const QStringList &files)
 {
-	std::map<std::string, std::tuple<std::string, LodEntry> > new_lod_entries;
+	auto new_archives = std::make_shared<DataArchives>();
 
 	for (const auto &file: files)
 	{
@@ -48,8 +53,10 @@ void Homm3MapSingleton::setDataArchives(const QStringList &files)
 
 			for (auto iter = parsed_lod_entries.begin(); iter != parsed_lod_entries.end(); ++iter)
 			{
-				new_lod_entries[iter->name] = std::tie(filename, *iter);
+				new_archives->lod_entries[iter->name] = std::tie(filename, *iter);
 			}
+
+			new_archives->files.append(QString::fromLocal8Bit(filename.c_str()));
 		}
 		catch (...)
 		{
@@ -57,5 +64,129 @@ void Homm3MapSingleton::setDataArchives(const QStringList &files)
 		}
 	}
 
-	lod_entries = std::move(new_lod_entries);
+	{
+		std::lock_guard<std::mutex> data_archives_lock(m_data_archives_mutex);
+		m_data_archives = new_archives;
+	}
+
+	// maps loaded from previous archives are not given to new requests
+	std::lock_guard<std::mutex> map_data_lock(m_map_data_mutex);
+	m_map_data.clear();
+}
+
+std::shared_ptr<const DataArchives> Homm3MapSingleton::getDataArchives() const
+{
+	std::lock_guard<std::mutex> data_archives_lock(m_data_archives_mutex);
+
+	return m_data_archives;
+}
+
+void Homm3MapSingleton::requestMapData(const QString &map_name, std::shared_ptr<CMap> map, int level, MapDataCallback callback)
+{
+	const MapDataKey key(map_name, level);
+
+	std::unique_lock<std::mutex> map_data_lock(m_map_data_mutex);
+
+	auto data_iter = m_map_data.find(key);
+	if (data_iter != m_map_data.end())
+	{
+		auto data = data_iter->second.lock();
+		if (data)
+		{
+			map_data_lock.unlock();
+			callback(data);
+			return;
+		}
+
+		m_map_data.erase(data_iter);
+	}
+
+	// if same map is already being loaded, its result is given to this request too
+	auto &requests = m_map_data_requests[key];
+	requests.push_back(std::move(callback));
+
+	if (requests.size() > 1)
+	{
+		return;
+	}
+
+	if (m_max_texture_size <= 0)
+	{
+		m_waiting_loads.emplace_back(key, map);
+		return;
+	}
+
+	const int max_texture_size = m_max_texture_size;
+
+	map_data_lock.unlock();
+
+	startLoading(key, map, max_texture_size);
+}
+
+void Homm3MapSingleton::setMaxTextureSize(int value)
+{
+	std::vector<std::pair<MapDataKey, std::shared_ptr<CMap> > > waiting_loads;
+
+	{
+		std::lock_guard<std::mutex> map_data_lock(m_map_data_mutex);
+
+		m_max_texture_size = value;
+		waiting_loads.swap(m_waiting_loads);
+	}
+
+	for (const auto &load: waiting_loads)
+	{
+		startLoading(load.first, load.second, value);
+	}
+}
+
+void Homm3MapSingleton::startLoading(const MapDataKey &key, std::shared_ptr<CMap> map, int max_texture_size)
+{
+	// workers never read archives which are being replaced
+	auto archives = getDataArchives();
+
+	m_worker_pool.start([this, key, map, archives, max_texture_size]() {
+		// map loaded earlier is read from disk, if neither it nor data archives changed since then
+		std::shared_ptr<const MapData> data = read_map_cache(key.first, key.second, *archives, max_texture_size);
+		const bool cached = static_cast<bool>(data);
+
+		if (!cached)
+		{
+			Homm3MapLoader loader(archives, max_texture_size);
+
+			auto connection = QObject::connect(&loader, &Homm3MapLoader::mapLoaded, [&data](std::shared_ptr<MapData> loaded_data) {
+				data = loaded_data;
+			});
+
+			loader.loadMapData(key.first, map, key.second);
+
+			QObject::disconnect(connection);
+		}
+
+		std::vector<MapDataCallback> callbacks;
+
+		{
+			std::lock_guard<std::mutex> map_data_lock(m_map_data_mutex);
+
+			// map loaded from previous archives is only given to requests which came before archives changed
+			if (data && data->m_map && (archives == getDataArchives()))
+			{
+				m_map_data[key] = data;
+			}
+
+			callbacks = std::move(m_map_data_requests[key]);
+			m_map_data_requests.erase(key);
+		}
+
+		for (const auto &callback: callbacks)
+		{
+			callback(data);
+		}
+
+		// map is already shown when it's written, it isn't changed by anyone
+		if ((!cached) && data)
+		{
+			write_map_cache(*data, key.second, *archives, max_texture_size);
+		}
+	});
 }
@@ -8,24 +8,87 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <utility>
+#include <vector>
 
 #include <QtCore/QObject>
+#include <QtCore/QSize>
 #include <QtCore/QStringList>
+#include <QtCore/QThreadPool>
+#include <QtGui/QOpenGLContext>
 
 #include "vcmi/CMap.h"
 
 #include "globals.h"
 
+struct MapData;
+class Homm3MapRenderer;
+
+// images found in data archives, replaced as a whole when archives change,
+// so that loaders keep reading archives which were current when they started
+struct DataArchives
+{
+	std::map<std::string, std::tuple<std::string, LodEntry> > lod_entries;
+
+	// archives which were read successfully, they are part of key of cached maps
+	QStringList files;
+};
+
+// atlas page uploaded once for all renderers whose contexts share textures,
+// maps with equal pages use same texture, so it's kept while any map uses it
+struct SharedAtlasPage
+{
+	QOpenGLContextGroup *share_group = nullptr;
+	uint64_t hash = 0;
+	QSize size;
+	GLuint texture_id = 0;
+
+	// pixels which page is uploaded from, equal hash doesn't guarantee equal pixels,
+	// so page is reused only while they can be compared
+	std::weak_ptr<const MapData> source;
+	size_t source_page = 0;
+
+	// renderer which fills page, others wait until page is complete and are updated when it is
+	const void *uploader = nullptr;
+	bool complete = false;
+	std::vector<Homm3MapRenderer*> waiting_renderers;
+
+	// page completed without waiting for GPU is usable only in context of renderer which completed it
+	const void *completed_by = nullptr;
+	bool finished = false;
+
+	size_t users = 0;
+};
+
 class Homm3MapSingleton
 {
 public:
+	typedef std::function<void(std::shared_ptr<const MapData>)> MapDataCallback;
+
 	static std::shared_ptr<Homm3MapSingleton> getInstance();
 
-	std::map<std::string, std::tuple<std::string, LodEntry> > lod_entries;
+	static constexpr int default_max_texture_size = 4096;
+
+	// used only by renderers while shared_atlas_pages_mutex is locked
+	std::list<SharedAtlasPage> shared_atlas_pages;
+	std::mutex shared_atlas_pages_mutex;
 
 	void setDataArchives(const QStringList &files);
+	std::shared_ptr<const DataArchives> getDataArchives() const;
+
+	// set by renderer once it knows limits of OpenGL implementation,
+	// maps are prepared only after that, so that they are packed and cached for real limit
+	void setMaxTextureSize(int value);
+
+	// Map data is prepared once for all map items which show same level of same map, and is kept while any of them holds it.
+	// Callback is called from worker thread, or right away if data is ready
+	void requestMapData(const QString &map_name, std::shared_ptr<CMap> map, int level, MapDataCallback callback);
 
 private:
 	Homm3MapSingleton() = default;
@@ -35,4 +98,22 @@ private:
 
 	static std::shared_ptr<Homm3MapSingleton> s_instance;
 	static std::mutex s_instance_mutex;
+
+	std::shared_ptr<const DataArchives> m_data_archives = std::make_shared<DataArchives>();
+	mutable std::mutex m_data_archives_mutex;
+
+	typedef std::pair<QString, int> MapDataKey;
+
+	std::map<MapDataKey, std::weak_ptr<const MapData> > m_map_data;
+	std::map<MapDataKey, std::vector<MapDataCallback> > m_map_data_requests;
+	std::mutex m_map_data_mutex;
+
+	// zero until renderer sets it, loads requested before that wait for it
+	int m_max_texture_size = 0;
+	std::vector<std::pair<MapDataKey, std::shared_ptr<CMap> > > m_waiting_loads;
+
+	void startLoading(const MapDataKey &key, std::shared_ptr<CMap> map, int max_texture_size);
+
+	// maps are loaded by few threads for all map items
+	QThreadPool m_worker_pool;
 };
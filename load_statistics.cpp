@@ -0,0 +1,291 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#include "load_statistics.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+Q_LOGGING_CATEGORY(homm3map_loader_log, "homm3map.loader", QtInfoMsg)
+Q_LOGGING_CATEGORY(homm3map_render_log, "homm3map.render", QtInfoMsg)
+
+#define render_statistics_interval_ms 10000
+
+thread_local LoadStageTimer *LoadStageTimer::s_current_timer = nullptr;
+
+void LoadStatistics::addStage(LoadStage stage, int64_t elapsed_ns, int64_t rss_delta)
+{
+	auto &stage_stats = m_stages[static_cast<size_t>(stage)];
+
+	stage_stats.elapsed_ns += elapsed_ns;
+	stage_stats.rss_delta += rss_delta;
+	++stage_stats.calls;
+}
+
+const LoadStageStatistics& LoadStatistics::getStage(LoadStage stage) const
+{
+	return m_stages[static_cast<size_t>(stage)];
+}
+
+void LoadStatistics::setCounter(const std::string &name, int64_t value)
+{
+	m_counters[name] = value;
+}
+
+int64_t LoadStatistics::getCounter(const std::string &name) const
+{
+	auto iter = m_counters.find(name);
+	if (iter == m_counters.end())
+	{
+		return 0;
+	}
+
+	return iter->second;
+}
+
+int64_t LoadStatistics::getTotalTime() const
+{
+	int64_t result = 0;
+
+	for (auto iter = m_stages.begin(); iter != m_stages.end(); ++iter)
+	{
+		result += iter->elapsed_ns;
+	}
+
+	return result;
+}
+
+QVariantMap LoadStatistics::toVariantMap() const
+{
+	QVariantMap stages;
+
+	for (size_t stage = 0; stage < m_stages.size(); ++stage)
+	{
+		QVariantMap stage_map;
+
+		stage_map[QStringLiteral("time_ms")] = static_cast<double>(m_stages[stage].elapsed_ns) / 1000000.0;
+		stage_map[QStringLiteral("rss_delta")] = static_cast<qint64>(m_stages[stage].rss_delta);
+		stage_map[QStringLiteral("calls")] = static_cast<qint64>(m_stages[stage].calls);
+
+		stages[QString::fromUtf8(getStageName(static_cast<LoadStage>(stage)))] = stage_map;
+	}
+
+	QVariantMap counters;
+
+	for (auto iter = m_counters.begin(); iter != m_counters.end(); ++iter)
+	{
+		counters[QString::fromStdString(iter->first)] = static_cast<qint64>(iter->second);
+	}
+
+	QVariantMap result;
+
+	result[QStringLiteral("total_time_ms")] = static_cast<double>(getTotalTime()) / 1000000.0;
+	result[QStringLiteral("stages")] = stages;
+	result[QStringLiteral("counters")] = counters;
+
+	return result;
+}
+
+void LoadStatistics::log(const QString &map_name, int level) const
+{
+	if (!homm3map_loader_log().isDebugEnabled())
+	{
+		return;
+	}
+
+	qCDebug(homm3map_loader_log) << "Map" << map_name << "level" << level << "loaded in" << (static_cast<double>(getTotalTime()) / 1000000.0) << "ms";
+
+	for (size_t stage = 0; stage < m_stages.size(); ++stage)
+	{
+		qCDebug(homm3map_loader_log).nospace() << "    " << getStageName(static_cast<LoadStage>(stage))
+			<< ": " << (static_cast<double>(m_stages[stage].elapsed_ns) / 1000000.0) << " ms, "
+			<< m_stages[stage].calls << " calls, rss delta " << m_stages[stage].rss_delta << " bytes";
+	}
+
+	for (auto iter = m_counters.begin(); iter != m_counters.end(); ++iter)
+	{
+		qCDebug(homm3map_loader_log).nospace() << "    " << iter->first.c_str() << ": " << iter->second;
+	}
+}
+
+const char* LoadStatistics::getStageName(LoadStage stage)
+{
+	switch (stage)
+	{
+	case LoadStage::inflate:
+		return "inflate";
+
+	case LoadStage::parse:
+		return "parse";
+
+	case LoadStage::def_resolve:
+		return "def_resolve";
+
+	case LoadStage::def_decode:
+		return "def_decode";
+
+	case LoadStage::atlas_pack:
+		return "atlas_pack";
+
+	case LoadStage::composition:
+		return "composition";
+
+	case LoadStage::vertex_build:
+		return "vertex_build";
+
+	case LoadStage::gl_upload:
+		return "gl_upload";
+
+	case LoadStage::map_cache:
+		return "map_cache";
+
+	case LoadStage::count:
+		break;
+	}
+
+	return "unknown";
+}
+
+int64_t LoadStatistics::getResidentMemory()
+{
+	int64_t result = 0;
+
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != nullptr)
+	{
+		long long total_pages = 0;
+		long long resident_pages = 0;
+
+		if (fscanf(statm, "%lld %lld", &total_pages, &resident_pages) == 2)
+		{
+			result = static_cast<int64_t>(resident_pages) * sysconf(_SC_PAGESIZE);
+		}
+
+		fclose(statm);
+	}
+
+	return result;
+}
+
+LoadStageTimer::LoadStageTimer(LoadStatistics &statistics, LoadStage stage)
+	: m_statistics(statistics)
+	, m_stage(stage)
+	, m_parent(s_current_timer)
+	, m_start_rss((s_current_timer == nullptr) ? LoadStatistics::getResidentMemory() : 0)
+	, m_excluded_ns(0)
+{
+	s_current_timer = this;
+
+	m_timer.start();
+}
+
+LoadStageTimer::~LoadStageTimer()
+{
+	const int64_t elapsed_ns = m_timer.nsecsElapsed();
+	const int64_t rss_delta = (m_parent == nullptr) ? (LoadStatistics::getResidentMemory() - m_start_rss) : 0;
+
+	m_statistics.addStage(m_stage, elapsed_ns - m_excluded_ns, rss_delta);
+
+	if (m_parent != nullptr)
+	{
+		m_parent->m_excluded_ns += elapsed_ns;
+	}
+
+	s_current_timer = m_parent;
+}
+
+CountingMemoryResource::CountingMemoryResource(std::pmr::memory_resource *upstream)
+	: m_upstream(upstream)
+{
+}
+
+size_t CountingMemoryResource::getAllocatedBytes() const
+{
+	return m_allocated_bytes;
+}
+
+size_t CountingMemoryResource::getPeakBytes() const
+{
+	return m_peak_bytes;
+}
+
+void* CountingMemoryResource::do_allocate(size_t bytes, size_t alignment)
+{
+	void *result = m_upstream->allocate(bytes, alignment);
+
+	m_allocated_bytes += bytes;
+	m_peak_bytes = std::max(m_peak_bytes, m_allocated_bytes);
+
+	return result;
+}
+
+void CountingMemoryResource::do_deallocate(void *ptr, size_t bytes, size_t alignment)
+{
+	m_upstream->deallocate(ptr, bytes, alignment);
+
+	m_allocated_bytes -= bytes;
+}
+
+bool CountingMemoryResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+	return (this == &other);
+}
+
+RenderStatistics::~RenderStatistics()
+{
+	if ((!m_session_timer.isValid()) || (m_session_frames == 0))
+	{
+		return;
+	}
+
+	const int64_t session_ns = std::max<int64_t>(m_session_timer.nsecsElapsed(), 1);
+
+	qCDebug(homm3map_render_log) << "Session:" << m_session_frames << "frames in" << (static_cast<double>(session_ns) / 1000000000.0) << "s,"
+		<< (static_cast<double>(m_session_frames) * 1000000000.0 / session_ns) << "frames per second,"
+		<< (static_cast<double>(m_session_elapsed_ns) / m_session_frames / 1000000.0) << "ms of CPU time per frame,"
+		<< (static_cast<double>(m_session_elapsed_ns) * 1000.0 / session_ns) << "ms of CPU time per second";
+}
+
+void RenderStatistics::addFrame(int64_t elapsed_ns, size_t vertices)
+{
+	if (!homm3map_render_log().isDebugEnabled())
+	{
+		return;
+	}
+
+	if (!m_interval_timer.isValid())
+	{
+		m_interval_timer.start();
+		m_session_timer.start();
+	}
+
+	++m_frames;
+	m_elapsed_ns += elapsed_ns;
+	m_vertices += vertices;
+
+	++m_session_frames;
+	m_session_elapsed_ns += elapsed_ns;
+
+	const int64_t interval_ns = m_interval_timer.nsecsElapsed();
+
+	if (interval_ns < static_cast<int64_t>(render_statistics_interval_ms) * 1000000)
+	{
+		return;
+	}
+
+	qCDebug(homm3map_render_log) << "Rendered" << (static_cast<double>(m_frames) * 1000000000.0 / interval_ns) << "frames per second,"
+		<< (static_cast<double>(m_elapsed_ns) / m_frames / 1000000.0) << "ms of CPU time per frame,"
+		<< (m_vertices / m_frames) << "vertices per frame";
+
+	m_frames = 0;
+	m_elapsed_ns = 0;
+	m_vertices = 0;
+	m_interval_timer.restart();
+}
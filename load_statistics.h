@@ -0,0 +1,141 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <map>
+#include <memory_resource>
+#include <string>
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QString>
+#include <QtCore/QVariantMap>
+
+Q_DECLARE_LOGGING_CATEGORY(homm3map_loader_log)
+Q_DECLARE_LOGGING_CATEGORY(homm3map_render_log)
+
+enum class LoadStage
+{
+	inflate,
+	parse,
+	def_resolve,
+	def_decode,
+	atlas_pack,
+	composition,
+	vertex_build,
+	gl_upload,
+	map_cache,
+	count
+};
+
+struct LoadStageStatistics
+{
+	int64_t elapsed_ns = 0;
+
+	// change of resident memory of whole process, so it includes memory of other loads and renderers running at same time,
+	// it's only measured for outermost stages and includes memory of stages nested in them
+	int64_t rss_delta = 0;
+	size_t calls = 0;
+};
+
+class LoadStatistics
+{
+public:
+	void addStage(LoadStage stage, int64_t elapsed_ns, int64_t rss_delta);
+	const LoadStageStatistics& getStage(LoadStage stage) const;
+
+	void setCounter(const std::string &name, int64_t value);
+	int64_t getCounter(const std::string &name) const;
+
+	int64_t getTotalTime() const;
+
+	QVariantMap toVariantMap() const;
+	void log(const QString &map_name, int level) const;
+
+	static const char* getStageName(LoadStage stage);
+
+	// memory usage of whole process, not only of the loader
+	static int64_t getResidentMemory();
+
+private:
+	std::array<LoadStageStatistics, static_cast<size_t>(LoadStage::count)> m_stages;
+	std::map<std::string, int64_t> m_counters;
+};
+
+// Measures time and memory between its construction and destruction.
+// Time of nested timers is excluded from the enclosing one, so stages never overlap.
+// Resident memory is only read by outermost timer, nested ones are too frequent for reading it from /proc.
+class LoadStageTimer
+{
+public:
+	LoadStageTimer(LoadStatistics &statistics, LoadStage stage);
+	~LoadStageTimer();
+
+	LoadStageTimer(const LoadStageTimer &other) = delete;
+	LoadStageTimer& operator=(const LoadStageTimer &other) = delete;
+
+private:
+	LoadStatistics &m_statistics;
+	LoadStage m_stage;
+
+	LoadStageTimer *m_parent;
+
+	QElapsedTimer m_timer;
+	int64_t m_start_rss;
+
+	int64_t m_excluded_ns;
+
+	static thread_local LoadStageTimer *s_current_timer;
+};
+
+// Passes allocations to upstream resource and remembers how much memory was taken from it,
+// so that size of arena is reported as it is and not estimated from sizes of its contents.
+class CountingMemoryResource: public std::pmr::memory_resource
+{
+public:
+	explicit CountingMemoryResource(std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+
+	size_t getAllocatedBytes() const;
+	size_t getPeakBytes() const;
+
+protected:
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *ptr, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+private:
+	std::pmr::memory_resource *m_upstream;
+	size_t m_allocated_bytes = 0;
+	size_t m_peak_bytes = 0;
+};
+
+// Counts rendered frames and CPU time spent on rendering them,
+// logs frames per second and average time per frame once per interval,
+// and for whole lifetime of renderer when it's destroyed, so that two sessions may be compared by one line.
+class RenderStatistics
+{
+public:
+	~RenderStatistics();
+
+	void addFrame(int64_t elapsed_ns, size_t vertices);
+
+private:
+	QElapsedTimer m_interval_timer;
+	size_t m_frames = 0;
+	int64_t m_elapsed_ns = 0;
+	size_t m_vertices = 0;
+
+	QElapsedTimer m_session_timer;
+	size_t m_session_frames = 0;
+	int64_t m_session_elapsed_ns = 0;
+};
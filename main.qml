@@ -25,19 +25,27 @@ Item {
 			map.toggleLevel();
 		}
 
+		// map is only drawn in size of view, flickable just moves camera over it
+		Homm3Map {
+			id: map
+			objectName: "map"
+			anchors.fill: parent
+
+			cameraX: view.contentX
+			cameraY: view.contentY
+
+			// right click switches levels, so both are prepared at once
+			prepareAllLevels: true
+		}
+
 		Flickable {
+			id: view
 			anchors.fill: parent
 			leftMargin: contentWidth >= width ? 0 : (width - contentWidth) / 2
 			topMargin: contentHeight >= height ? 0 : (height - contentHeight) / 2
-			contentItem.clip: true
-
-			contentWidth: map.width
-			contentHeight: map.height
 
-			Homm3Map {
-				id: map
-				objectName: "map"
-			}
+			contentWidth: map.contentWidth
+			contentHeight: map.contentHeight
 		}
 	}
 }
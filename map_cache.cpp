@@ -0,0 +1,553 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#include "map_cache.h"
+
+#include <dlfcn.h>
+#include <string.h>
+
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include <zlib.h>
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QUrl>
+
+#include "homm3map.h"
+#include "homm3singleton.h"
+#include "load_statistics.h"
+
+namespace {
+
+// must be increased whenever output of loader or layout of cache file changes
+const uint32_t map_cache_version = 3;
+
+// least recently used maps are removed when all cached maps take more space
+const int64_t max_map_cache_size = 512 * 1024 * 1024;
+
+const char map_cache_magic[8] = { 'H', '3', 'M', 'C', 'A', 'C', 'H', 'E' };
+
+// cache file is only read on same machine, so values are stored in native byte order
+struct MapCacheHeader
+{
+	char magic[8];
+	uint32_t version = 0;
+	uint32_t checksum = 0;
+	uint64_t payload_size = 0;
+	char key[20];
+};
+
+static_assert(std::is_trivially_copyable<SpriteInstance>::value, "sprites are stored as raw bytes");
+
+QString getLocalFile(const QString &name)
+{
+	QUrl file_url(name);
+	file_url.setScheme(QLatin1String("file"));
+
+	return file_url.toLocalFile();
+}
+
+void addKeyValue(QCryptographicHash &hash, const QByteArray &value)
+{
+	// values are separated, so that different values never give same key
+	hash.addData(value);
+	hash.addData(QByteArrayView("\0", 1));
+}
+
+void addKeyFile(QCryptographicHash &hash, const QString &filename)
+{
+	QFileInfo file_info(filename);
+
+	addKeyValue(hash, file_info.absoluteFilePath().toUtf8());
+	addKeyValue(hash, QByteArray::number(file_info.size()));
+	addKeyValue(hash, QByteArray::number(file_info.lastModified().toMSecsSinceEpoch()));
+}
+
+// file containing this code, i.e. plugin or executable, identifies build which wrote cache file
+QString getBinaryFile()
+{
+	static const QString binary_file = []() -> QString {
+		Dl_info info;
+
+		if ((dladdr(reinterpret_cast<void*>(&getBinaryFile), &info) != 0) && (info.dli_fname != nullptr))
+		{
+			return QString::fromLocal8Bit(info.dli_fname);
+		}
+
+		return QString();
+	}();
+
+	return binary_file;
+}
+
+QByteArray getMapCacheKey(const QString &map_name, int level, const DataArchives &archives, int max_texture_size)
+{
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+
+	addKeyValue(hash, QByteArray::number(map_cache_version));
+	addKeyFile(hash, getBinaryFile());
+	addKeyValue(hash, QByteArray::number(level));
+	addKeyValue(hash, QByteArray::number(max_texture_size));
+	addKeyFile(hash, getLocalFile(map_name));
+
+	for (const auto &archive: archives.files)
+	{
+		addKeyFile(hash, archive);
+	}
+
+	return hash.result();
+}
+
+QString getMapCacheDirectory()
+{
+	const QString cache_location = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+
+	if (cache_location.isEmpty())
+	{
+		return QString();
+	}
+
+	return cache_location + QLatin1String("/homm3-wallpaper");
+}
+
+QString getMapCacheFile(const QByteArray &key)
+{
+	const QString directory = getMapCacheDirectory();
+
+	if (directory.isEmpty())
+	{
+		return QString();
+	}
+
+	return directory + QLatin1Char('/') + QString::fromLatin1(key.toHex()) + QLatin1String(".map");
+}
+
+class MapCacheWriter
+{
+public:
+	explicit MapCacheWriter(QIODevice &device)
+		: m_device(device)
+	{
+	}
+
+	void write(const void *data, size_t size)
+	{
+		const auto *bytes = static_cast<const Bytef*>(data);
+
+		m_success = m_success && (m_device.write(reinterpret_cast<const char*>(bytes), size) == static_cast<qint64>(size));
+
+		// zlib takes length as unsigned int
+		for (size_t offset = 0; offset < size; )
+		{
+			const uInt length = std::min<size_t>(size - offset, 1 << 30);
+			m_checksum = crc32(m_checksum, bytes + offset, length);
+			offset += length;
+		}
+
+		m_size += size;
+	}
+
+	template <typename T>
+	void writeValue(T value)
+	{
+		write(&value, sizeof(value));
+	}
+
+	template <typename T>
+	void writeVector(const std::vector<T> &values)
+	{
+		writeValue<uint64_t>(values.size());
+		write(values.data(), values.size() * sizeof(T));
+	}
+
+	void writeRect(const QRect &rect)
+	{
+		writeValue<int32_t>(rect.x());
+		writeValue<int32_t>(rect.y());
+		writeValue<int32_t>(rect.width());
+		writeValue<int32_t>(rect.height());
+	}
+
+	bool success() const { return m_success; }
+	uint32_t checksum() const { return m_checksum; }
+	uint64_t size() const { return m_size; }
+
+private:
+	QIODevice &m_device;
+	bool m_success = true;
+	uLong m_checksum = crc32(0, Z_NULL, 0);
+	uint64_t m_size = 0;
+};
+
+// every read is checked against end of file, so damaged file never makes reader go past it
+class MapCacheReader
+{
+public:
+	MapCacheReader(const uchar *data, size_t size)
+		: m_data(data)
+		, m_size(size)
+	{
+	}
+
+	void read(void *data, size_t size)
+	{
+		if ((!m_success) || (size > m_size - m_position))
+		{
+			m_success = false;
+			memset(data, 0, size);
+			return;
+		}
+
+		memcpy(data, m_data + m_position, size);
+		m_position += size;
+	}
+
+	template <typename T>
+	T readValue()
+	{
+		T value;
+		read(&value, sizeof(value));
+		return value;
+	}
+
+	template <typename T>
+	void readVector(std::vector<T> &values)
+	{
+		const uint64_t count = readValue<uint64_t>();
+
+		if ((!m_success) || (count > (m_size - m_position) / sizeof(T)))
+		{
+			m_success = false;
+			return;
+		}
+
+		values.resize(count);
+		read(values.data(), count * sizeof(T));
+	}
+
+	QRect readRect()
+	{
+		const int32_t x = readValue<int32_t>();
+		const int32_t y = readValue<int32_t>();
+		const int32_t width = readValue<int32_t>();
+		const int32_t height = readValue<int32_t>();
+
+		return QRect(x, y, width, height);
+	}
+
+	bool success() const { return m_success; }
+	bool atEnd() const { return m_position == m_size; }
+
+private:
+	const uchar *m_data;
+	size_t m_size;
+	size_t m_position = 0;
+	bool m_success = true;
+};
+
+bool readPayload(MapCacheReader &reader, MapData &data, int max_texture_size)
+{
+	auto map = std::make_shared<CMap>();
+	map->width = reader.readValue<int32_t>();
+	map->height = reader.readValue<int32_t>();
+	map->twoLevel = (reader.readValue<uint8_t>() != 0);
+
+	data.m_map = map;
+	data.m_map_tiles_loaded = false;
+	data.m_level = reader.readValue<int32_t>();
+	data.m_animation_cycle = std::max<uint64_t>(reader.readValue<uint64_t>(), 1);
+
+	reader.readVector(data.m_sprites);
+
+	const uint64_t batches = reader.readValue<uint64_t>();
+
+	for (uint64_t i = 0; reader.success() && (i < batches); ++i)
+	{
+		DrawBatch batch;
+		batch.page = reader.readValue<uint64_t>();
+		batch.first = reader.readValue<uint64_t>();
+		batch.count = reader.readValue<uint64_t>();
+		batch.bounds = reader.readRect();
+
+		data.m_draw_batches.push_back(batch);
+	}
+
+	const uint64_t pages = reader.readValue<uint64_t>();
+	std::vector<QSize> page_sizes;
+
+	for (uint64_t page = 0; reader.success() && (page < pages); ++page)
+	{
+		const int32_t width = reader.readValue<int32_t>();
+		const int32_t height = reader.readValue<int32_t>();
+
+		// pages might have been packed for bigger textures than current OpenGL implementation supports
+		if (std::max(width, height) > max_texture_size)
+		{
+			return false;
+		}
+
+		page_sizes.push_back(QSize(width, height));
+		data.m_page_hashes.push_back(reader.readValue<uint64_t>());
+
+		data.m_texture_data.emplace_back();
+		reader.readVector(data.m_texture_data.back());
+
+		if (data.m_texture_data.back().size() != static_cast<size_t>(std::max(width, 0)) * std::max(height, 0))
+		{
+			return false;
+		}
+	}
+
+	data.m_texture_atlas.setPages(page_sizes);
+
+	reader.readVector(data.m_palette_data);
+	reader.readVector(data.m_ground_tiles);
+	reader.readVector(data.m_ground_items);
+
+	std::vector<uint64_t> ground_pages;
+	reader.readVector(ground_pages);
+	data.m_ground_pages.assign(ground_pages.begin(), ground_pages.end());
+
+	const uint64_t areas = reader.readValue<uint64_t>();
+
+	for (uint64_t i = 0; reader.success() && (i < areas); ++i)
+	{
+		data.m_animated_areas.push_back(reader.readRect());
+	}
+
+	const uint64_t levels = reader.readValue<uint64_t>();
+
+	for (uint64_t i = 0; reader.success() && (i < levels); ++i)
+	{
+		MapLevel level;
+		level.level = reader.readValue<int32_t>();
+		level.first_batch = reader.readValue<uint64_t>();
+		level.batches = reader.readValue<uint64_t>();
+		level.first_area = reader.readValue<uint64_t>();
+		level.areas = reader.readValue<uint64_t>();
+
+		// ranges must stay inside of map data
+		if ((level.first_batch + level.batches > data.m_draw_batches.size()) || (level.first_area + level.areas > data.m_animated_areas.size()))
+		{
+			return false;
+		}
+
+		data.m_levels.push_back(level);
+	}
+
+	return reader.success() && reader.atEnd() && (!data.m_levels.empty());
+}
+
+void removeOldFiles(const QString &directory)
+{
+	QFileInfoList files = QDir(directory).entryInfoList(QStringList { QStringLiteral("*.map") }, QDir::Files, QDir::Time);
+	int64_t total_size = 0;
+
+	// files are sorted from most recently used one
+	for (const auto &file: files)
+	{
+		total_size += file.size();
+
+		if (total_size > max_map_cache_size)
+		{
+			QFile::remove(file.absoluteFilePath());
+		}
+	}
+}
+
+} // unnamed namespace
+
+std::shared_ptr<MapData> read_map_cache(const QString &map_name, int level, const DataArchives &archives, int max_texture_size)
+{
+	const QByteArray key = getMapCacheKey(map_name, level, archives, max_texture_size);
+	const QString filename = getMapCacheFile(key);
+
+	if (filename.isEmpty())
+	{
+		return std::shared_ptr<MapData>();
+	}
+
+	QFile file(filename);
+
+	if ((!file.open(QIODevice::ReadOnly)) || (file.size() < static_cast<qint64>(sizeof(MapCacheHeader))))
+	{
+		return std::shared_ptr<MapData>();
+	}
+
+	std::shared_ptr<MapData> result = std::make_shared<MapData>();
+	bool valid = false;
+
+	{
+		LoadStageTimer stage_timer(result->m_statistics, LoadStage::map_cache);
+
+		// file is mapped, so its data is copied straight from page cache
+		uchar *file_data = file.map(0, file.size());
+
+		if (file_data)
+		{
+			MapCacheHeader header;
+			memcpy(&header, file_data, sizeof(header));
+
+			const uchar *payload = file_data + sizeof(header);
+			const size_t payload_size = file.size() - sizeof(header);
+
+			valid = (memcmp(header.magic, map_cache_magic, sizeof(map_cache_magic)) == 0)
+				&& (header.version == map_cache_version)
+				&& (header.payload_size == payload_size)
+				&& (key.size() == sizeof(header.key))
+				&& (memcmp(header.key, key.constData(), sizeof(header.key)) == 0);
+
+			uLong checksum = crc32(0, Z_NULL, 0);
+
+			for (size_t offset = 0; valid && (offset < payload_size); )
+			{
+				const uInt length = std::min<size_t>(payload_size - offset, 1 << 30);
+				checksum = crc32(checksum, payload + offset, length);
+				offset += length;
+			}
+
+			if (valid && (checksum == header.checksum))
+			{
+				MapCacheReader reader(payload, payload_size);
+				valid = readPayload(reader, *result, max_texture_size);
+			}
+			else
+			{
+				valid = false;
+			}
+
+			file.unmap(file_data);
+		}
+	}
+
+	if (!valid)
+	{
+		// damaged or outdated file is written again after map is loaded
+		file.close();
+		QFile::remove(filename);
+
+		return std::shared_ptr<MapData>();
+	}
+
+	result->m_name = map_name;
+	result->m_statistics.setCounter("map_cache_size", file.size());
+
+	// modification time orders files for removal of least recently used ones
+	file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+
+	return result;
+}
+
+void write_map_cache(const MapData &data, int level, const DataArchives &archives, int max_texture_size)
+{
+	if ((!data.m_map) || data.m_texture_data.empty())
+	{
+		return;
+	}
+
+	const QByteArray key = getMapCacheKey(data.m_name, level, archives, max_texture_size);
+	const QString filename = getMapCacheFile(key);
+
+	if (filename.isEmpty() || (!QDir().mkpath(QFileInfo(filename).absolutePath())))
+	{
+		return;
+	}
+
+	QElapsedTimer write_timer;
+	write_timer.start();
+
+	QSaveFile file(filename);
+
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		return;
+	}
+
+	MapCacheHeader header;
+	memcpy(header.magic, map_cache_magic, sizeof(map_cache_magic));
+	memcpy(header.key, key.constData(), std::min<size_t>(key.size(), sizeof(header.key)));
+	header.version = map_cache_version;
+
+	// header is written again when checksum of payload is known
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	MapCacheWriter writer(file);
+
+	writer.writeValue<int32_t>(data.m_map->width);
+	writer.writeValue<int32_t>(data.m_map->height);
+	writer.writeValue<uint8_t>(data.m_map->twoLevel ? 1 : 0);
+	writer.writeValue<int32_t>(data.m_level);
+	writer.writeValue<uint64_t>(data.m_animation_cycle);
+
+	writer.writeVector(data.m_sprites);
+
+	writer.writeValue<uint64_t>(data.m_draw_batches.size());
+
+	for (const auto &batch: data.m_draw_batches)
+	{
+		writer.writeValue<uint64_t>(batch.page);
+		writer.writeValue<uint64_t>(batch.first);
+		writer.writeValue<uint64_t>(batch.count);
+		writer.writeRect(batch.bounds);
+	}
+
+	writer.writeValue<uint64_t>(data.m_texture_data.size());
+
+	for (size_t page = 0; page < data.m_texture_data.size(); ++page)
+	{
+		const auto page_size = data.m_texture_atlas.getPageSize(page);
+
+		writer.writeValue<int32_t>(page_size.width());
+		writer.writeValue<int32_t>(page_size.height());
+		writer.writeValue<uint64_t>(data.m_page_hashes[page]);
+		writer.writeVector(data.m_texture_data[page]);
+	}
+
+	writer.writeVector(data.m_palette_data);
+	writer.writeVector(data.m_ground_tiles);
+	writer.writeVector(data.m_ground_items);
+	writer.writeVector(std::vector<uint64_t>(data.m_ground_pages.begin(), data.m_ground_pages.end()));
+
+	writer.writeValue<uint64_t>(data.m_animated_areas.size());
+
+	for (const auto &area: data.m_animated_areas)
+	{
+		writer.writeRect(area);
+	}
+
+	writer.writeValue<uint64_t>(data.m_levels.size());
+
+	for (const auto &level: data.m_levels)
+	{
+		writer.writeValue<int32_t>(level.level);
+		writer.writeValue<uint64_t>(level.first_batch);
+		writer.writeValue<uint64_t>(level.batches);
+		writer.writeValue<uint64_t>(level.first_area);
+		writer.writeValue<uint64_t>(level.areas);
+	}
+
+	header.checksum = writer.checksum();
+	header.payload_size = writer.size();
+
+	if ((!writer.success()) || (!file.seek(0)) || (file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)) || (!file.commit()))
+	{
+		return;
+	}
+
+	qCDebug(homm3map_loader_log) << "Cached map" << data.m_name << "level" << level << "in" << write_timer.elapsed() << "ms," << (sizeof(header) + writer.size()) << "bytes";
+
+	removeOldFiles(QFileInfo(filename).absolutePath());
+}
@@ -0,0 +1,22 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#pragma once
+
+#include <memory>
+
+#include <QtCore/QString>
+
+struct DataArchives;
+struct MapData;
+
+// Prepared maps are kept in cache directory of user, so same map is not loaded again after restart.
+// Cache file is chosen by map file, level, data archives, maximum texture size used for packing, binary which wrote it and cache version,
+// file with wrong checksum is removed. Cached map only has header of map without its tiles.
+std::shared_ptr<MapData> read_map_cache(const QString &map_name, int level, const DataArchives &archives, int max_texture_size);
+void write_map_cache(const MapData &data, int level, const DataArchives &archives, int max_texture_size);
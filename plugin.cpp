@@ -10,12 +10,14 @@
 
 #include "homm3_image_provider.h"
 #include "homm3map.h"
+#include "screen_lock_watcher.h"
 
 void HOMM3MapPlugin::registerTypes(const char *uri)
 {
 	Q_ASSERT(uri == QLatin1String("homm3map"));
 
 	qmlRegisterType<Homm3Map>("homm3map", 1, 0, "Homm3Map");
+	qmlRegisterType<ScreenLockWatcher>("homm3map", 1, 0, "ScreenLockWatcher");
 }
 
 void HOMM3MapPlugin::initializeEngine(QQmlEngine *engine, const char *uri)
@@ -19,3 +19,8 @@ CRandomGenerator::CRandomGenerator()
 	: m_generator(std::random_device{}())
 {
 }
+
+CRandomGenerator::CRandomGenerator(std::seed_seq &seed)
+	: m_generator(seed)
+{
+}
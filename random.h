@@ -14,6 +14,7 @@ class CRandomGenerator
 {
 public:
 	CRandomGenerator();
+	explicit CRandomGenerator(std::seed_seq &seed);
 
 	template <typename T>
 	T nextInt(T min, T max)
@@ -0,0 +1,60 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#include "screen_lock_watcher.h"
+
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusPendingCallWatcher>
+#include <QtDBus/QDBusPendingReply>
+
+namespace {
+
+const char screen_saver_service[] = "org.freedesktop.ScreenSaver";
+const char screen_saver_path[] = "/ScreenSaver";
+const char screen_saver_interface[] = "org.freedesktop.ScreenSaver";
+
+} // unnamed namespace
+
+ScreenLockWatcher::ScreenLockWatcher(QObject *parent)
+	: QObject(parent)
+	, m_locked(false)
+{
+	auto bus = QDBusConnection::sessionBus();
+
+	bus.connect(QLatin1String(screen_saver_service), QLatin1String(screen_saver_path), QLatin1String(screen_saver_interface), QStringLiteral("ActiveChanged"), this, SLOT(setLocked(bool)));
+
+	// screen may already be locked when wallpaper is created
+	auto call = bus.asyncCall(QDBusMessage::createMethodCall(QLatin1String(screen_saver_service), QLatin1String(screen_saver_path), QLatin1String(screen_saver_interface), QStringLiteral("GetActive")));
+	auto call_watcher = new QDBusPendingCallWatcher(call, this);
+
+	QObject::connect(call_watcher, &QDBusPendingCallWatcher::finished, this, [this](QDBusPendingCallWatcher *finished_call) {
+		QDBusPendingReply<bool> reply = *finished_call;
+
+		if (reply.isValid())
+		{
+			setLocked(reply.value());
+		}
+
+		finished_call->deleteLater();
+	});
+}
+
+bool ScreenLockWatcher::isLocked() const
+{
+	return m_locked;
+}
+
+void ScreenLockWatcher::setLocked(bool value)
+{
+	if (m_locked != value)
+	{
+		m_locked = value;
+		Q_EMIT lockedChanged(m_locked);
+	}
+}
@@ -0,0 +1,34 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#pragma once
+
+#include <QtCore/QObject>
+
+// Follows screen locker through org.freedesktop.ScreenSaver,
+// wallpaper window stays exposed under lock screen, so it can't tell it by itself
+class ScreenLockWatcher: public QObject
+{
+	Q_OBJECT
+
+	Q_PROPERTY(bool locked READ isLocked NOTIFY lockedChanged);
+
+public:
+	explicit ScreenLockWatcher(QObject *parent = nullptr);
+
+	bool isLocked() const;
+
+Q_SIGNALS:
+	void lockedChanged(bool locked);
+
+private Q_SLOTS:
+	void setLocked(bool value);
+
+private:
+	bool m_locked;
+};
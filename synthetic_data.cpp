@@ -0,0 +1,672 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#include "synthetic_data.h"
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include <fstream>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "vcmi/CMap.h"
+#include "vcmi/GameConstants.h"
+
+#include "globals.h"
+
+namespace {
+
+struct SyntheticDef
+{
+	const char *name;
+	DefType type;
+	uint32_t width;
+	uint32_t height;
+	uint32_t frames;
+	uint32_t compression;
+	bool trimmed;
+};
+
+// every compression type is used at least once, like in original archives
+const SyntheticDef synthetic_defs[] = {
+	{ "dirttl.def",  DefType::terrain, 32,  32,  24, 2, false },
+	{ "sandtl.def",  DefType::terrain, 32,  32,  24, 3, false },
+	{ "grastl.def",  DefType::terrain, 32,  32,  24, 2, false },
+	{ "snowtl.def",  DefType::terrain, 32,  32,  24, 3, false },
+	{ "swmptl.def",  DefType::terrain, 32,  32,  24, 2, false },
+	{ "rougtl.def",  DefType::terrain, 32,  32,  24, 3, false },
+	{ "subbtl.def",  DefType::terrain, 32,  32,  24, 2, false },
+	{ "lavatl.def",  DefType::terrain, 32,  32,  24, 3, false },
+	{ "watrtl.def",  DefType::terrain, 32,  32,  33, 2, false },
+	{ "rocktl.def",  DefType::terrain, 32,  32,  24, 0, false },
+	{ "clrrvr.def",  DefType::terrain, 32,  32,  13, 3, false },
+	{ "icyrvr.def",  DefType::terrain, 32,  32,  13, 2, false },
+	{ "mudrvr.def",  DefType::terrain, 32,  32,  13, 3, false },
+	{ "lavrvr.def",  DefType::terrain, 32,  32,  13, 2, false },
+	{ "dirtrd.def",  DefType::terrain, 32,  32,  17, 3, false },
+	{ "gravrd.def",  DefType::terrain, 32,  32,  17, 2, false },
+	{ "cobbrd.def",  DefType::terrain, 32,  32,  17, 3, false },
+	{ "edg.def",     DefType::terrain, 32,  32,  36, 0, false },
+	{ "synobs0.def", DefType::map,     64,  32,  1,  1, true },
+	{ "synobs1.def", DefType::map,     96,  64,  1,  1, true },
+	{ "synobs2.def", DefType::map,     128, 96,  1,  1, true },
+	{ "synmill.def", DefType::map,     96,  64,  6,  1, true },
+	{ "synmine.def", DefType::map,     96,  64,  4,  1, true },
+};
+
+// indexed by ETerrainType, ERiverType and ERoadType respectively
+const char * const terrain_defs[] = { "dirttl.def", "sandtl.def", "grastl.def", "snowtl.def", "swmptl.def", "rougtl.def", "subbtl.def", "lavatl.def", "watrtl.def", "rocktl.def" };
+const char * const river_defs[] = { nullptr, "clrrvr.def", "icyrvr.def", "mudrvr.def", "lavrvr.def" };
+const char * const road_defs[] = { nullptr, "dirtrd.def", "gravrd.def", "cobbrd.def" };
+
+const ETerrainType surface_terrains[] = { ETerrainType::DIRT, ETerrainType::SAND, ETerrainType::GRASS, ETerrainType::SNOW, ETerrainType::SWAMP, ETerrainType::ROUGH, ETerrainType::LAVA, ETerrainType::WATER };
+const ETerrainType underground_terrains[] = { ETerrainType::SUBTERRANEAN, ETerrainType::DIRT, ETerrainType::LAVA, ETerrainType::WATER, ETerrainType::ROCK };
+
+struct SyntheticObject
+{
+	const char *def_name;
+	Obj id;
+	uint8_t visit_mask;
+	bool has_owner;
+};
+
+// object types without additional data in map file, except for mines which have owner
+const SyntheticObject synthetic_objects[] = {
+	{ "synobs0.def", static_cast<Obj>(118),  0x00, false },
+	{ "synobs1.def", static_cast<Obj>(118),  0x00, false },
+	{ "synobs2.def", static_cast<Obj>(118),  0x00, false },
+	{ "synmill.def", Obj::WINDMILL,          0x08, false },
+	{ "synmine.def", Obj::MINE,              0x04, true },
+};
+
+const int map_sizes[] = { CMapHeader::MAP_SIZE_SMALL, CMapHeader::MAP_SIZE_MIDDLE, CMapHeader::MAP_SIZE_LARGE, CMapHeader::MAP_SIZE_XLARGE };
+const char * const map_size_names[] = { "s", "m", "l", "xl" };
+
+class ByteWriter
+{
+public:
+	void writeUInt8(uint8_t value)
+	{
+		m_data.push_back(value);
+	}
+
+	void writeUInt16(uint16_t value)
+	{
+		writeUInt8(value & 0xFF);
+		writeUInt8(value >> 8);
+	}
+
+	void writeUInt32(uint32_t value)
+	{
+		writeUInt16(value & 0xFFFF);
+		writeUInt16(value >> 16);
+	}
+
+	void writeString(const std::string &value)
+	{
+		writeUInt32(value.size());
+		m_data.insert(m_data.end(), value.begin(), value.end());
+	}
+
+	void writeSizedString(const std::string &value, size_t size)
+	{
+		if (value.size() >= size)
+		{
+			throw std::runtime_error("String is too long");
+		}
+
+		m_data.insert(m_data.end(), value.begin(), value.end());
+		writeZeros(size - value.size());
+	}
+
+	void writeZeros(size_t count)
+	{
+		m_data.insert(m_data.end(), count, 0);
+	}
+
+	void write(const uint8_t *data, size_t size)
+	{
+		m_data.insert(m_data.end(), data, data + size);
+	}
+
+	void setUInt16(size_t position, uint16_t value)
+	{
+		m_data.at(position) = value & 0xFF;
+		m_data.at(position + 1) = value >> 8;
+	}
+
+	void setUInt32(size_t position, uint32_t value)
+	{
+		setUInt16(position, value & 0xFFFF);
+		setUInt16(position + 2, value >> 16);
+	}
+
+	size_t size() const
+	{
+		return m_data.size();
+	}
+
+	std::vector<uint8_t>& data()
+	{
+		return m_data;
+	}
+
+private:
+	std::vector<uint8_t> m_data;
+};
+
+uint32_t hash_values(std::initializer_list<uint32_t> values)
+{
+	uint32_t result = 0x811c9dc5u;
+
+	for (auto value: values)
+	{
+		result ^= value + 0x9e3779b9u + (result << 6) + (result >> 2);
+	}
+
+	result ^= result >> 16;
+	result *= 0x7feb352du;
+	result ^= result >> 15;
+	result *= 0x846ca68bu;
+	result ^= result >> 16;
+
+	return result;
+}
+
+const SyntheticDef& find_synthetic_def(const std::string &name)
+{
+	for (const auto &def: synthetic_defs)
+	{
+		if (name == def.name)
+		{
+			return def;
+		}
+	}
+
+	throw std::runtime_error("Unknown synthetic image: " + name);
+}
+
+std::vector<uint8_t> compress_data(const std::vector<uint8_t> &data, bool gzip)
+{
+	z_stream stream {};
+
+	// same window bits as CCompressedStream expects
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, gzip ? 31 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		throw std::runtime_error("Failed to initialize compression");
+	}
+
+	std::vector<uint8_t> result(deflateBound(&stream, data.size()));
+
+	stream.next_in = const_cast<Bytef*>(data.data());
+	stream.avail_in = data.size();
+	stream.next_out = result.data();
+	stream.avail_out = result.size();
+
+	int status = deflate(&stream, Z_FINISH);
+	result.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	if (status != Z_STREAM_END)
+	{
+		throw std::runtime_error("Failed to compress data");
+	}
+
+	return result;
+}
+
+void write_file(const std::filesystem::path &filename, const std::vector<uint8_t> &data)
+{
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+
+	file.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+	if (!file)
+	{
+		throw std::runtime_error("Failed to write file " + filename.string());
+	}
+}
+
+// palette indices below 8 are special colors: transparency, shadows and player color
+std::vector<uint8_t> make_frame_pixels(uint32_t seed, size_t def_index, uint32_t frame, uint32_t width, uint32_t height, bool has_border)
+{
+	std::vector<uint8_t> result(width * height);
+
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		for (uint32_t x = 0; x < width; ++x)
+		{
+			uint32_t cell = hash_values({ seed, static_cast<uint32_t>(def_index), frame, x / 4, y / 2 });
+			uint8_t pixel;
+
+			if (has_border && ((x < 2) || (y < 2) || (x + 2 >= width) || (y + 2 >= height)))
+			{
+				pixel = (x + y) % 2;
+			}
+			else if (cell % 4 == 0)
+			{
+				pixel = cell % 7;
+			}
+			else
+			{
+				pixel = 8 + (cell >> 8) % 248;
+			}
+
+			result[y * width + x] = pixel;
+		}
+	}
+
+	return result;
+}
+
+// splits pixels into repeated special colors and raw sequences of regular colors
+template <typename T>
+void encode_segments(const uint8_t *pixels, size_t count, size_t max_length, uint8_t max_run_index, T emit_func)
+{
+	size_t position = 0;
+
+	while (position < count)
+	{
+		size_t length = 1;
+
+		if (pixels[position] < max_run_index)
+		{
+			while ((position + length < count) && (length < max_length) && (pixels[position + length] == pixels[position]))
+			{
+				++length;
+			}
+
+			emit_func(true, pixels + position, length);
+		}
+		else
+		{
+			while ((position + length < count) && (length < max_length) && (pixels[position + length] >= max_run_index))
+			{
+				++length;
+			}
+
+			emit_func(false, pixels + position, length);
+		}
+
+		position += length;
+	}
+}
+
+std::vector<uint8_t> encode_frame(const std::vector<uint8_t> &pixels, uint32_t width, uint32_t height, uint32_t compression)
+{
+	ByteWriter writer;
+
+	switch (compression)
+	{
+	case 0:
+		writer.write(pixels.data(), pixels.size());
+		break;
+
+	case 1:
+		writer.writeZeros(4 * height);
+
+		for (uint32_t row = 0; row < height; ++row)
+		{
+			writer.setUInt32(4 * row, writer.size());
+
+			encode_segments(pixels.data() + row * width, width, 256, 8, [&writer](bool is_run, const uint8_t *data, size_t length) {
+				writer.writeUInt8(is_run ? data[0] : 0xFF);
+				writer.writeUInt8(length - 1);
+
+				if (!is_run)
+				{
+					writer.write(data, length);
+				}
+			});
+		}
+		break;
+
+	case 2:
+	case 3:
+		{
+			// compression 2 has one offset per row, compression 3 has one offset per 32 pixels
+			size_t segment_length = (compression == 2) ? width : 32;
+			size_t segments_count = pixels.size() / segment_length;
+
+			if ((compression == 3) && (width % 32 != 0))
+			{
+				throw std::runtime_error("Invalid frame width for compression 3");
+			}
+
+			writer.writeZeros(2 * segments_count);
+
+			for (size_t segment = 0; segment < segments_count; ++segment)
+			{
+				if (writer.size() > 0xFFFF)
+				{
+					throw std::runtime_error("Frame is too big");
+				}
+
+				writer.setUInt16(2 * segment, writer.size());
+
+				encode_segments(pixels.data() + segment * segment_length, segment_length, 32, 7, [&writer](bool is_run, const uint8_t *data, size_t length) {
+					writer.writeUInt8(((is_run ? data[0] : 0x07) << 5) | (length - 1));
+
+					if (!is_run)
+					{
+						writer.write(data, length);
+					}
+				});
+			}
+		}
+		break;
+
+	default:
+		throw std::runtime_error("Invalid compression type");
+	}
+
+	return std::move(writer.data());
+}
+
+std::vector<uint8_t> make_def_file(uint32_t seed, size_t def_index)
+{
+	const SyntheticDef &def = synthetic_defs[def_index];
+
+	ByteWriter writer;
+
+	writer.writeUInt32(static_cast<uint32_t>(def.type));
+	writer.writeUInt32(def.width);
+	writer.writeUInt32(def.height);
+	writer.writeUInt32(1); // groups count
+
+	for (uint32_t color = 0; color < 256; ++color)
+	{
+		uint32_t value = hash_values({ seed, static_cast<uint32_t>(def_index), color });
+
+		writer.writeUInt8(value & 0xFF);
+		writer.writeUInt8((value >> 8) & 0xFF);
+		writer.writeUInt8((value >> 16) & 0xFF);
+	}
+
+	writer.writeUInt32(0); // group type
+	writer.writeUInt32(def.frames);
+	writer.writeZeros(8);
+
+	std::string name_prefix = std::string(def.name).substr(0, std::string(def.name).find('.')).substr(0, 6);
+
+	for (uint32_t frame = 0; frame < def.frames; ++frame)
+	{
+		char frame_suffix[8];
+		snprintf(frame_suffix, sizeof(frame_suffix), "%02u.pcx", frame);
+
+		writer.writeSizedString(name_prefix + frame_suffix, 13);
+	}
+
+	size_t offsets_position = writer.size();
+	writer.writeZeros(4 * def.frames);
+
+	for (uint32_t frame = 0; frame < def.frames; ++frame)
+	{
+		writer.setUInt32(offsets_position + 4 * frame, writer.size());
+
+		// objects have transparent margins which are cut off
+		uint32_t x = def.trimmed ? def.width / 8 + frame % 3 : 0;
+		uint32_t y = def.trimmed ? def.height / 4 : 0;
+		uint32_t width = def.width - x - (def.trimmed ? def.width / 8 : 0);
+		uint32_t height = def.height - y;
+
+		auto pixels = make_frame_pixels(seed, def_index, frame, width, height, def.trimmed);
+		auto encoded = encode_frame(pixels, width, height, def.compression);
+
+		writer.writeUInt32(encoded.size());
+		writer.writeUInt32(def.compression);
+		writer.writeUInt32(def.width);
+		writer.writeUInt32(def.height);
+		writer.writeUInt32(width);
+		writer.writeUInt32(height);
+		writer.writeUInt32(x);
+		writer.writeUInt32(y);
+		writer.write(encoded.data(), encoded.size());
+	}
+
+	return std::move(writer.data());
+}
+
+void write_lod_archive(const std::filesystem::path &filename, uint32_t seed)
+{
+	const size_t files_count = sizeof(synthetic_defs) / sizeof(synthetic_defs[0]);
+	const size_t header_size = 4 + 4 + 4 + 80;
+	const size_t entry_size = 16 + 4 + 4 + 4 + 4;
+
+	ByteWriter header;
+	ByteWriter contents;
+
+	header.write(reinterpret_cast<const uint8_t*>("LOD"), 4);
+	header.writeUInt32(500);
+	header.writeUInt32(files_count);
+	header.writeZeros(80);
+
+	for (size_t def_index = 0; def_index < files_count; ++def_index)
+	{
+		auto data = make_def_file(seed, def_index);
+		auto compressed = compress_data(data, false);
+
+		header.writeSizedString(synthetic_defs[def_index].name, 16);
+		header.writeUInt32(header_size + entry_size * files_count + contents.size());
+		header.writeUInt32(data.size());
+		header.writeUInt32(static_cast<uint32_t>(synthetic_defs[def_index].type));
+
+		// files which don't shrink are stored as is
+		if (compressed.size() < data.size())
+		{
+			header.writeUInt32(compressed.size());
+			contents.write(compressed.data(), compressed.size());
+		}
+		else
+		{
+			header.writeUInt32(0);
+			contents.write(data.data(), data.size());
+		}
+	}
+
+	header.write(contents.data().data(), contents.size());
+
+	write_file(filename, header.data());
+}
+
+struct SyntheticTile
+{
+	ETerrainType terrain = ETerrainType::DIRT;
+	ERiverType river = ERiverType::NO_RIVER;
+	ERoadType road = ERoadType::NO_ROAD;
+};
+
+std::vector<uint8_t> make_map_file(uint32_t seed, int size)
+{
+	const int levels = 2;
+
+	ByteWriter writer;
+
+	// header
+	writer.writeUInt32(static_cast<uint32_t>(EMapFormat::SOD));
+	writer.writeUInt8(1); // are any players on map
+	writer.writeUInt32(size);
+	writer.writeUInt8(levels > 1);
+	writer.writeString("Synthetic map");
+	writer.writeString("Generated for loader benchmark");
+	writer.writeUInt8(1); // difficulty
+	writer.writeUInt8(0); // level limit
+
+	// nobody can play any player
+	for (int player = 0; player < static_cast<int>(PlayerColor::PLAYER_LIMIT_I); ++player)
+	{
+		writer.writeUInt8(0);
+		writer.writeUInt8(0);
+		writer.writeZeros(13);
+	}
+
+	writer.writeUInt8(0xFF); // standard victory condition
+	writer.writeUInt8(0xFF); // standard loss condition
+	writer.writeUInt8(0); // teams
+	writer.writeZeros(20); // allowed heroes
+	writer.writeUInt32(0); // placeholders
+	writer.writeUInt8(0); // disposed heroes
+	writer.writeZeros(31);
+	writer.writeZeros(18); // allowed artifacts
+	writer.writeZeros(13); // allowed spells and abilities
+	writer.writeUInt32(0); // rumors
+	writer.writeZeros(GameConstants::HEROES_QUANTITY); // predefined heroes
+
+	// terrain
+	std::vector<SyntheticTile> tiles(levels * size * size);
+
+	for (int level = 0; level < levels; ++level)
+	{
+		for (int y = 0; y < size; ++y)
+		{
+			for (int x = 0; x < size; ++x)
+			{
+				auto &tile = tiles[(level * size + y) * size + x];
+				uint32_t cell = hash_values({ seed, static_cast<uint32_t>(size), static_cast<uint32_t>(level), static_cast<uint32_t>(x / 6), static_cast<uint32_t>(y / 6) });
+				uint32_t value = hash_values({ seed, static_cast<uint32_t>(size), static_cast<uint32_t>(level), static_cast<uint32_t>(x), static_cast<uint32_t>(y) });
+
+				if (level == 0)
+				{
+					tile.terrain = surface_terrains[cell % (sizeof(surface_terrains) / sizeof(surface_terrains[0]))];
+				}
+				else
+				{
+					tile.terrain = underground_terrains[cell % (sizeof(underground_terrains) / sizeof(underground_terrains[0]))];
+				}
+
+				bool is_land = (tile.terrain != ETerrainType::WATER) && (tile.terrain != ETerrainType::ROCK);
+
+				if (is_land && (y % 17 == 5) && ((x / 9) % 2 == 0))
+				{
+					tile.river = static_cast<ERiverType>(1 + (cell >> 8) % 4);
+				}
+
+				if (is_land && (x % 13 == 7))
+				{
+					tile.road = static_cast<ERoadType>(1 + (cell >> 16) % 3);
+				}
+
+				uint8_t flags = value & 0x03;
+				uint8_t river_dir = 0;
+				uint8_t road_dir = 0;
+
+				if (tile.river != ERiverType::NO_RIVER)
+				{
+					river_dir = (value >> 8) % find_synthetic_def(river_defs[static_cast<int>(tile.river)]).frames;
+					flags |= ((value >> 2) & 0x03) << 2;
+				}
+
+				if (tile.road != ERoadType::NO_ROAD)
+				{
+					road_dir = (value >> 16) % find_synthetic_def(road_defs[static_cast<int>(tile.road)]).frames;
+					flags |= ((value >> 4) & 0x03) << 4;
+				}
+
+				writer.writeUInt8(static_cast<uint8_t>(tile.terrain));
+				writer.writeUInt8((value >> 24) % find_synthetic_def(terrain_defs[static_cast<int>(tile.terrain)]).frames);
+				writer.writeUInt8(static_cast<uint8_t>(tile.river));
+				writer.writeUInt8(river_dir);
+				writer.writeUInt8(static_cast<uint8_t>(tile.road));
+				writer.writeUInt8(road_dir);
+				writer.writeUInt8(flags);
+			}
+		}
+	}
+
+	// object templates
+	const size_t templates_count = sizeof(synthetic_objects) / sizeof(synthetic_objects[0]);
+
+	writer.writeUInt32(templates_count);
+
+	for (const auto &object: synthetic_objects)
+	{
+		writer.writeString(object.def_name);
+		writer.writeZeros(6); // block mask
+		writer.writeZeros(5); // visit mask
+		writer.writeUInt8(object.visit_mask);
+		writer.writeZeros(2);
+		writer.writeZeros(2); // terrain mask
+		writer.writeUInt32(static_cast<uint32_t>(object.id));
+		writer.writeUInt32(0); // subid
+		writer.writeUInt8(0); // type
+		writer.writeUInt8(0); // print priority
+		writer.writeZeros(16);
+	}
+
+	// objects, roughly one per ten free tiles
+	ByteWriter objects_writer;
+	uint32_t objects_count = 0;
+
+	for (int level = 0; level < levels; ++level)
+	{
+		for (int y = 0; y < size; ++y)
+		{
+			for (int x = 0; x < size; ++x)
+			{
+				const auto &tile = tiles[(level * size + y) * size + x];
+				uint32_t value = hash_values({ seed, static_cast<uint32_t>(size), static_cast<uint32_t>(level), static_cast<uint32_t>(x), static_cast<uint32_t>(y), 1 });
+
+				if ((tile.terrain == ETerrainType::WATER) || (tile.terrain == ETerrainType::ROCK) || (tile.river != ERiverType::NO_RIVER) || (tile.road != ERoadType::NO_ROAD) || (value % 10 != 0))
+				{
+					continue;
+				}
+
+				size_t template_index = (value >> 8) % templates_count;
+
+				objects_writer.writeUInt8(x);
+				objects_writer.writeUInt8(y);
+				objects_writer.writeUInt8(level);
+				objects_writer.writeUInt32(template_index);
+				objects_writer.writeZeros(5);
+
+				if (synthetic_objects[template_index].has_owner)
+				{
+					uint32_t owner = (value >> 16) % 9;
+
+					objects_writer.writeUInt8((owner < static_cast<uint32_t>(PlayerColor::PLAYER_LIMIT_I)) ? owner : 0xFF);
+					objects_writer.writeZeros(3);
+				}
+
+				++objects_count;
+			}
+		}
+	}
+
+	writer.writeUInt32(objects_count);
+	writer.write(objects_writer.data().data(), objects_writer.size());
+
+	writer.writeUInt32(0); // events
+
+	return std::move(writer.data());
+}
+
+} // unnamed namespace
+
+SyntheticData generate_synthetic_data(const std::filesystem::path &directory, uint32_t seed)
+{
+	SyntheticData result;
+
+	std::filesystem::create_directories(directory);
+
+	result.archive = directory / "synthetic.lod";
+	write_lod_archive(result.archive, seed);
+
+	for (size_t i = 0; i < sizeof(map_sizes) / sizeof(map_sizes[0]); ++i)
+	{
+		auto filename = directory / (std::string("synthetic_") + map_size_names[i] + ".h3m");
+
+		write_file(filename, compress_data(make_map_file(seed, map_sizes[i]), true));
+
+		result.maps.push_back(filename);
+	}
+
+	return result;
+}
@@ -0,0 +1,24 @@
+/*
+ * homm3-wallpaper, live HOMM3 wallpaper
+ * Copyright (C) 2024 i.Dark_Templar <darktemplar@dark-templar-archives.net>
+ *
+ * Subject to terms and condition provided in LICENSE.txt
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <filesystem>
+#include <vector>
+
+struct SyntheticData
+{
+	std::filesystem::path archive;
+	std::vector<std::filesystem::path> maps;
+};
+
+// Writes LOD archive with all images used by generated maps and gzip-compressed SOD maps of every size.
+// Output depends only on seed, so same seed always produces same files.
+SyntheticData generate_synthetic_data(const std::filesystem::path &directory, uint32_t seed);
@@ -8,6 +8,11 @@
 
 #include "texture_atlas.h"
 
+#include <limits.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
 #include <tuple>
 
 TextureItem::TextureItem(const std::string &l_name, int l_group, int l_frame, int l_special)
@@ -23,90 +28,467 @@ bool TextureItem::operator<(const TextureItem &other) const
 	return std::tie(this->name, this->group, this->frame, this->special) < std::tie(other.name, other.group, other.frame, other.special);
 }
 
+bool TextureItem::operator==(const TextureItem &other) const
+{
+	return std::tie(this->name, this->group, this->frame, this->special) == std::tie(other.name, other.group, other.frame, other.special);
+}
+
+size_t TextureItemHash::operator()(const TextureItem &item) const
+{
+	size_t result = std::hash<std::string>()(item.name);
+
+	for (int value: { item.group, item.frame, item.special })
+	{
+		result ^= std::hash<int>()(value) + 0x9e3779b9 + (result << 6) + (result >> 2);
+	}
+
+	return result;
+}
+
 TextureAtlas::TextureAtlas()
-	: m_size(1024)
-	, m_current_height(0)
+	: m_packed(false)
+	, m_used_area(0)
+	, m_common_items(0)
 {
 	clear();
 }
 
-void TextureAtlas::insertItem(const TextureItem &item, const QSize &size)
+TextureHandle TextureAtlas::insertItem(const TextureItem &item, const QSize &full_size)
+{
+	return insertItem(item, full_size, QRect(QPoint(0, 0), full_size));
+}
+
+TextureHandle TextureAtlas::insertItem(const TextureItem &item, const QSize &full_size, const QRect &bounds, size_t frames)
 {
 	// first ensure that it's not allocated yet
-	if (itemIsPresent(item))
+	auto insert_result = m_handles.emplace(item, m_items.size());
+	if (!insert_result.second)
+	{
+		return insert_result.first->second;
+	}
+
+	TexturePosition position;
+	position.rect = QRect(QPoint(0, 0), bounds.size());
+	position.offset = bounds.topLeft();
+	position.full_size = full_size;
+	position.frames = std::max<size_t>(frames, 1);
+
+	m_items.push_back(item);
+	m_positions.push_back(position);
+	m_originals.push_back(insert_result.first->second);
+	m_packed = false;
+
+	return insert_result.first->second;
+}
+
+void TextureAtlas::pack(int max_page_size)
+{
+	if (m_packed)
 	{
 		return;
 	}
 
-	for (;;)
+	std::vector<TextureHandle> items;
+
+	items.reserve(m_positions.size());
+	m_used_area = 0;
+
+	for (TextureHandle handle = 0; handle < m_positions.size(); ++handle)
 	{
-		// check to find if there's line of correct height with enough free space is present
-		for (auto lines_iter = m_current_lines.begin(); lines_iter != m_current_lines.end(); ++lines_iter)
+		if (isDuplicate(handle))
 		{
-			if ((lines_iter->line_height == size.height()) && (m_size - lines_iter->current_width >= size.width()))
+			continue;
+		}
+
+		auto &position = m_positions[handle];
+		auto &rect = position.rect;
+
+		// grid of frames is kept close to square, but never wider than page
+		position.columns = 1;
+
+		if ((position.frames > 1) && (!rect.isEmpty()))
+		{
+			const int max_columns = std::min<int>(position.frames, std::max(max_page_size / rect.width(), 1));
+
+			position.columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(position.frames) * rect.height() / rect.width())));
+			position.columns = std::min(std::max(position.columns, 1), max_columns);
+		}
+
+		rect.setSize(QSize(rect.width() * position.columns, rect.height() * getGridRows(position)));
+
+		// such items can't be placed on any page
+		if ((rect.width() > max_page_size) || (rect.height() > max_page_size))
+		{
+			rect = QRect();
+			continue;
+		}
+
+		items.push_back(handle);
+		m_used_area += static_cast<size_t>(rect.width()) * static_cast<size_t>(rect.height());
+	}
+
+	// place biggest items first, small ones fill remaining gaps,
+	// items of equal size are ordered by name so that frames of same image stay together
+	std::sort(items.begin(), items.end(), [this](TextureHandle first, TextureHandle second) {
+		const auto &first_rect = m_positions[first].rect;
+		const auto &second_rect = m_positions[second].rect;
+
+		if (first_rect.height() != second_rect.height())
+		{
+			return first_rect.height() > second_rect.height();
+		}
+
+		if (first_rect.width() != second_rect.width())
+		{
+			return first_rect.width() > second_rect.width();
+		}
+
+		return m_items[first] < m_items[second];
+	});
+
+	// common items never share pages with other items, so their pages don't depend on the rest of atlas
+	std::vector<TextureHandle> common_items;
+
+	std::copy_if(items.begin(), items.end(), std::back_inserter(common_items), [this](TextureHandle handle) { return isCommonItem(handle); });
+	items.erase(std::remove_if(items.begin(), items.end(), [this](TextureHandle handle) { return isCommonItem(handle); }), items.end());
+
+	m_pages.clear();
+
+	for (auto *page_items: { &common_items, &items })
+	{
+		while (!page_items->empty())
+		{
+			std::vector<TextureHandle> remaining_items;
+
+			m_pages.push_back(packPage(*page_items, max_page_size, remaining_items));
+
+			page_items->swap(remaining_items);
+		}
+	}
+
+	// grids are placed, only their first frames are kept
+	for (TextureHandle handle = 0; handle < m_positions.size(); ++handle)
+	{
+		if (!isDuplicate(handle))
+		{
+			auto &position = m_positions[handle];
+
+			position.rect.setSize(QSize(position.rect.width() / position.columns, position.rect.height() / getGridRows(position)));
+		}
+	}
+
+	for (TextureHandle handle = 0; handle < m_positions.size(); ++handle)
+	{
+		if (isDuplicate(handle))
+		{
+			m_positions[handle].page = m_positions[m_originals[handle]].page;
+			m_positions[handle].rect = m_positions[m_originals[handle]].rect;
+			m_positions[handle].columns = m_positions[m_originals[handle]].columns;
+		}
+	}
+
+	m_packed = true;
+}
+
+void TextureAtlas::setDuplicate(TextureHandle handle, TextureHandle original)
+{
+	if ((handle >= m_originals.size()) || (original >= m_originals.size()) || (handle == original) || isDuplicate(original))
+	{
+		return;
+	}
+
+	m_originals[handle] = original;
+	m_positions[handle].rect = QRect(QPoint(0, 0), m_positions[original].rect.size());
+	m_packed = false;
+}
+
+bool TextureAtlas::isDuplicate(TextureHandle handle) const
+{
+	return (handle < m_originals.size()) && (m_originals[handle] != handle);
+}
+
+void TextureAtlas::finishCommonItems()
+{
+	m_common_items = m_items.size();
+	m_packed = false;
+}
+
+bool TextureAtlas::isCommonItem(TextureHandle handle) const
+{
+	return (handle < m_common_items);
+}
+
+QSize TextureAtlas::packPage(const std::vector<TextureHandle> &items, int max_page_size, std::vector<TextureHandle> &remaining_items)
+{
+	const size_t page = m_pages.size();
+
+	size_t total_area = 0;
+	int min_width = 0;
+
+	for (auto item: items)
+	{
+		total_area += static_cast<size_t>(m_positions[item].rect.width()) * static_cast<size_t>(m_positions[item].rect.height());
+		min_width = std::max(min_width, m_positions[item].rect.width());
+	}
+
+	// if everything fits into one page, try few widths around square root of total area and keep the one giving smallest page
+	static const int width_percents[] = { 100, 110, 125, 150 };
+
+	const int base_width = std::max(static_cast<int>(std::ceil(std::sqrt(static_cast<double>(total_area)))), min_width);
+
+	std::vector<QPoint> best_positions(items.size());
+	QSize best_size;
+	bool found = false;
+
+	for (auto percent: width_percents)
+	{
+		const int width = std::min(std::max(base_width * percent / 100, min_width), max_page_size);
+
+		std::vector<SkylineSegment> skyline;
+		skyline.push_back(SkylineSegment { 0, 0, width });
+
+		QSize size(0, 0);
+		bool all_placed = true;
+
+		for (auto item: items)
+		{
+			if (!placeItem(skyline, m_positions[item].rect, width, max_page_size))
 			{
-				m_texture_items[item] = QRect(QPoint(lines_iter->current_width, lines_iter->line_y), size);
-				lines_iter->current_width += size.width();
-				return;
+				all_placed = false;
+				break;
 			}
+
+			size = size.expandedTo(QSize(m_positions[item].rect.x() + m_positions[item].rect.width(), m_positions[item].rect.y() + m_positions[item].rect.height()));
+		}
+
+		if (!all_placed)
+		{
+			continue;
 		}
 
-		// no free lines found, allocate one
-		if (m_size - m_current_height >= size.height())
+		if ((!found)
+			|| (static_cast<int64_t>(size.width()) * size.height() < static_cast<int64_t>(best_size.width()) * best_size.height())
+			|| ((static_cast<int64_t>(size.width()) * size.height() == static_cast<int64_t>(best_size.width()) * best_size.height()) && (std::max(size.width(), size.height()) < std::max(best_size.width(), best_size.height()))))
 		{
-			m_texture_items[item] = QRect(QPoint(0, m_current_height), size);
+			best_size = size;
+			found = true;
 
-			Line newline;
-			newline.line_y = m_current_height;
-			newline.line_height = size.height();
-			newline.current_width = size.width();
-			m_current_lines.push_back(newline);
+			for (size_t i = 0; i < items.size(); ++i)
+			{
+				best_positions[i] = m_positions[items[i]].rect.topLeft();
+			}
+		}
+	}
 
-			m_current_height += size.height();
-			return;
+	if (found)
+	{
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			m_positions[items[i]].rect.moveTopLeft(best_positions[i]);
+			m_positions[items[i]].page = page;
 		}
 
-		// no free height either, increase size and try searching again
-		m_size *= 2;
+		return best_size;
 	}
+
+	// page is full, fill it and leave items which don't fit for next pages
+	QSize result(0, 0);
+
+	std::vector<SkylineSegment> skyline;
+	skyline.push_back(SkylineSegment { 0, 0, max_page_size });
+
+	for (auto item: items)
+	{
+		if (placeItem(skyline, m_positions[item].rect, max_page_size, max_page_size))
+		{
+			m_positions[item].page = page;
+			result = result.expandedTo(QSize(m_positions[item].rect.x() + m_positions[item].rect.width(), m_positions[item].rect.y() + m_positions[item].rect.height()));
+		}
+		else
+		{
+			remaining_items.push_back(item);
+		}
+	}
+
+	return result;
 }
 
-bool TextureAtlas::itemIsPresent(const TextureItem &item) const
+int TextureAtlas::getGridRows(const TexturePosition &position)
 {
-	return (m_texture_items.find(item) != m_texture_items.end());
+	return static_cast<int>((position.frames + position.columns - 1) / position.columns);
 }
 
-QRect TextureAtlas::findItem(const TextureItem &item) const
+bool TextureAtlas::placeItem(std::vector<SkylineSegment> &skyline, QRect &rect, int width, int max_height)
 {
-	auto iter = m_texture_items.find(item);
-	if (iter == m_texture_items.end())
+	if (rect.isEmpty())
+	{
+		rect.moveTopLeft(QPoint(0, 0));
+		return true;
+	}
+
+	// skyline covers whole page width, each segment is the lowest free position over its span
+	size_t best_index = skyline.size();
+	int best_y = INT_MAX;
+
+	for (size_t i = 0; (i < skyline.size()) && (skyline[i].x + rect.width() <= width); ++i)
+	{
+		int y = 0;
+		int remaining_width = rect.width();
+
+		for (size_t j = i; remaining_width > 0; ++j)
+		{
+			y = std::max(y, skyline[j].y);
+			remaining_width -= skyline[j].width;
+		}
+
+		if (y < best_y)
+		{
+			best_y = y;
+			best_index = i;
+		}
+	}
+
+	if ((best_index == skyline.size()) || (best_y + rect.height() > max_height))
+	{
+		return false;
+	}
+
+	const int item_x = skyline[best_index].x;
+	const int item_right = item_x + rect.width();
+
+	rect.moveTopLeft(QPoint(item_x, best_y));
+
+	// remove or shorten segments covered by new item
+	size_t index = best_index;
+
+	while ((index < skyline.size()) && (skyline[index].x < item_right))
+	{
+		const int segment_right = skyline[index].x + skyline[index].width;
+
+		if (segment_right <= item_right)
+		{
+			skyline.erase(skyline.begin() + index);
+		}
+		else
+		{
+			skyline[index].width = segment_right - item_right;
+			skyline[index].x = item_right;
+			break;
+		}
+	}
+
+	skyline.insert(skyline.begin() + best_index, SkylineSegment { item_x, best_y + rect.height(), rect.width() });
+
+	// merge neighbour segments of same height
+	for (size_t i = 1; i < skyline.size(); )
 	{
-		iter = m_texture_items.find(TextureItem("invalid"));
-		if (iter == m_texture_items.end())
+		if (skyline[i - 1].y == skyline[i].y)
 		{
-			return QRect();
+			skyline[i - 1].width += skyline[i].width;
+			skyline.erase(skyline.begin() + i);
 		}
+		else
+		{
+			++i;
+		}
+	}
+
+	return true;
+}
+
+bool TextureAtlas::itemIsPresent(const TextureItem &item) const
+{
+	return (m_handles.find(item) != m_handles.end());
+}
+
+TextureHandle TextureAtlas::findHandle(const TextureItem &item) const
+{
+	auto iter = m_handles.find(item);
+	if (iter == m_handles.end())
+	{
+		return invalid_handle;
 	}
 
 	return iter->second;
 }
 
-size_t TextureAtlas::getSize() const
+size_t TextureAtlas::getItemsCount() const
+{
+	return m_items.size();
+}
+
+const TextureItem& TextureAtlas::getItem(TextureHandle handle) const
+{
+	if (handle >= m_items.size())
+	{
+		handle = invalid_handle;
+	}
+
+	return m_items[handle];
+}
+
+const TexturePosition& TextureAtlas::getPosition(TextureHandle handle) const
 {
-	return m_size;
+	if (handle >= m_positions.size())
+	{
+		handle = invalid_handle;
+	}
+
+	return m_positions[handle];
+}
+
+void TextureAtlas::setPages(const std::vector<QSize> &pages)
+{
+	clear();
+
+	m_pages = pages;
+	m_packed = true;
+}
+
+size_t TextureAtlas::getPagesCount() const
+{
+	return m_pages.size();
+}
+
+QSize TextureAtlas::getPageSize(size_t page) const
+{
+	if (page >= m_pages.size())
+	{
+		return QSize();
+	}
+
+	return m_pages[page];
 }
 
-std::pair<std::map<TextureItem, QRect>::const_iterator, std::map<TextureItem, QRect>::const_iterator> TextureAtlas::getAllItems() const
+double TextureAtlas::getFillRatio() const
 {
-	return std::make_pair(m_texture_items.begin(), m_texture_items.end());
+	double total_area = 0.0;
+
+	for (const auto &page_size: m_pages)
+	{
+		total_area += static_cast<double>(page_size.width()) * static_cast<double>(page_size.height());
+	}
+
+	if (total_area <= 0.0)
+	{
+		return 0.0;
+	}
+
+	return static_cast<double>(m_used_area) / total_area;
 }
 
 void TextureAtlas::clear()
 {
-	m_size = 1024;
-	m_current_height = 0;
-	m_current_lines.clear();
-	m_texture_items.clear();
+	m_pages.clear();
+	m_packed = false;
+	m_used_area = 0;
+	m_common_items = 0;
+	m_items.clear();
+	m_positions.clear();
+	m_originals.clear();
+	m_handles.clear();
 
+	// always gets first handle
 	insertItem(TextureItem("invalid"), QSize(tile_size, tile_size));
+	pack(tile_size);
 }
@@ -10,10 +10,9 @@
 
 #include <stddef.h>
 
-#include <list>
-#include <map>
 #include <string>
-#include <utility>
+#include <unordered_map>
+#include <vector>
 
 #include <QtCore/QRect>
 
@@ -30,6 +29,29 @@ struct TextureItem
 	explicit TextureItem(const std::string &l_name, int l_group = 0, int l_frame = 0, int l_special = -1);
 
 	bool operator<(const TextureItem &other) const;
+	bool operator==(const TextureItem &other) const;
+};
+
+struct TextureItemHash
+{
+	size_t operator()(const TextureItem &item) const;
+};
+
+// dense index of item in atlas, handles stay valid until atlas is cleared
+typedef size_t TextureHandle;
+
+struct TexturePosition
+{
+	size_t page = 0;
+	QRect rect;
+
+	// only part of image is kept in atlas, it's placed at offset inside of image of full size
+	QPoint offset;
+	QSize full_size;
+
+	// frames of animated image are rows of grid with given count of columns, rect is position of first frame
+	size_t frames = 1;
+	int columns = 1;
 };
 
 class TextureAtlas
@@ -37,28 +59,65 @@ class TextureAtlas
 public:
 	TextureAtlas();
 
-	void insertItem(const TextureItem &item, const QSize &size);
+	// handle of item which is displayed instead of missing images
+	static constexpr TextureHandle invalid_handle = 0;
+
+	// items only get their position when atlas is packed,
+	// inserting already present item returns its existing handle,
+	// all frames of animated image are kept in one item and have same bounds
+	TextureHandle insertItem(const TextureItem &item, const QSize &full_size);
+	TextureHandle insertItem(const TextureItem &item, const QSize &full_size, const QRect &bounds, size_t frames = 1);
+
+	// duplicate gets position of original item when atlas is packed, original must not be a duplicate itself
+	void setDuplicate(TextureHandle handle, TextureHandle original);
+	bool isDuplicate(TextureHandle handle) const;
+
+	// items inserted so far are same for every map, they are packed into pages of their own,
+	// so these pages are equal between maps and can be shared
+	void finishCommonItems();
+	bool isCommonItem(TextureHandle handle) const;
+
+	// pages are never bigger than max_page_size in any dimension,
+	// frames of animated image are placed as one grid, so animation never switches pages
+	void pack(int max_page_size);
 
 	bool itemIsPresent(const TextureItem &item) const;
-	QRect findItem(const TextureItem &item) const;
+	TextureHandle findHandle(const TextureItem &item) const;
+
+	size_t getItemsCount() const;
+	const TextureItem& getItem(TextureHandle handle) const;
+	const TexturePosition& getPosition(TextureHandle handle) const;
 
-	size_t getSize() const;
+	// atlas of prepared map read from cache only knows its pages, positions of items are not needed anymore
+	void setPages(const std::vector<QSize> &pages);
 
-	std::pair<std::map<TextureItem, QRect>::const_iterator, std::map<TextureItem, QRect>::const_iterator> getAllItems() const;
+	size_t getPagesCount() const;
+	QSize getPageSize(size_t page) const;
+	double getFillRatio() const;
 
 	void clear();
 
 private:
-	struct Line
+	struct SkylineSegment
 	{
-		size_t line_height = 0;
-		size_t line_y = 0;
-		size_t current_width = 0;
+		int x = 0;
+		int y = 0;
+		int width = 0;
 	};
 
-	size_t m_size;
-	size_t m_current_height;
-	std::list<Line> m_current_lines;
+	std::vector<QSize> m_pages;
+	bool m_packed;
+	size_t m_used_area;
+	size_t m_common_items;
+
+	// items and their positions are indexed by handle
+	std::vector<TextureItem> m_items;
+	std::vector<TexturePosition> m_positions;
+	std::vector<TextureHandle> m_originals;
+	std::unordered_map<TextureItem, TextureHandle, TextureItemHash> m_handles;
+
+	QSize packPage(const std::vector<TextureHandle> &items, int max_page_size, std::vector<TextureHandle> &remaining_items);
 
-	std::map<TextureItem, QRect> m_texture_items;
+	static bool placeItem(std::vector<SkylineSegment> &skyline, QRect &rect, int width, int max_height);
+	static int getGridRows(const TexturePosition &position);
 };
@@ -32,6 +32,14 @@ ColumnLayout {
 	property int cfg_InitialPositionYDefault: -1
 	property double cfg_Scale
 	property double cfg_ScaleDefault: 1.0
+	property bool cfg_AnimationEnabled
+	property bool cfg_AnimationEnabledDefault: true
+	property int cfg_MaxAnimationRate
+	property int cfg_MaxAnimationRateDefault: 0
+	property bool cfg_PauseWhenObscured
+	property bool cfg_PauseWhenObscuredDefault: true
+	property bool cfg_PauseOnBattery
+	property bool cfg_PauseOnBatteryDefault: false
 
 	property int hoursIntervalValue: Math.floor(cfg_RefreshTime / 3600)
 	property int minutesIntervalValue: Math.floor((cfg_RefreshTime % 3600) / 60)
@@ -340,5 +348,79 @@ ColumnLayout {
 				}
 			}
 		}
+
+		RowLayout {
+			Kirigami.FormData.label: i18nd("homm3mapwallpaper", "Animation:")
+
+			CheckBox {
+				id: animationEnabledCheckBox
+				text: i18nd("homm3mapwallpaper", "Animate map")
+				checked: cfg_AnimationEnabled
+				onToggled: root.cfg_AnimationEnabled = animationEnabledCheckBox.checked
+
+				KCM.SettingHighlighter {
+					highlight: cfg_AnimationEnabled !== cfg_AnimationEnabledDefault
+				}
+			}
+		}
+
+		RowLayout {
+			Kirigami.FormData.label: i18nd("homm3mapwallpaper", "Maximal animation rate:")
+
+			SpinBox {
+				id: maxAnimationRateBox
+				value: root.cfg_MaxAnimationRate
+				from: 0
+				to: 5
+				enabled: cfg_AnimationEnabled
+				editable: true
+				onValueChanged: cfg_MaxAnimationRate = maxAnimationRateBox.value
+
+				textFromValue: function(value, locale) {
+					if (value == 0)
+					{
+						return i18nd("homm3mapwallpaper", "Game speed");
+					}
+
+					return i18ndp("homm3mapwallpaper", "%1 frame per second", "%1 frames per second", value);
+				}
+				valueFromText: function(text, locale) {
+					var value = parseInt(text);
+					return isNaN(value) ? 0 : value;
+				}
+
+				KCM.SettingHighlighter {
+					highlight: cfg_MaxAnimationRate != cfg_MaxAnimationRateDefault
+				}
+			}
+		}
+
+		RowLayout {
+			CheckBox {
+				id: pauseWhenObscuredCheckBox
+				text: i18nd("homm3mapwallpaper", "Pause animation while wallpaper is hidden by maximized windows or lock screen")
+				checked: cfg_PauseWhenObscured
+				enabled: cfg_AnimationEnabled
+				onToggled: root.cfg_PauseWhenObscured = pauseWhenObscuredCheckBox.checked
+
+				KCM.SettingHighlighter {
+					highlight: cfg_PauseWhenObscured !== cfg_PauseWhenObscuredDefault
+				}
+			}
+		}
+
+		RowLayout {
+			CheckBox {
+				id: pauseOnBatteryCheckBox
+				text: i18nd("homm3mapwallpaper", "Pause animation while on battery")
+				checked: cfg_PauseOnBattery
+				enabled: cfg_AnimationEnabled
+				onToggled: root.cfg_PauseOnBattery = pauseOnBatteryCheckBox.checked
+
+				KCM.SettingHighlighter {
+					highlight: cfg_PauseOnBattery !== cfg_PauseOnBatteryDefault
+				}
+			}
+		}
 	}
 }
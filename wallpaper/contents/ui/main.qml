@@ -7,8 +7,11 @@
  */
 
 import QtQuick
+import QtQuick.Window
 import org.kde.plasma.core as PlasmaCore
 import org.kde.plasma.plasmoid
+import org.kde.plasma.plasma5support as P5Support
+import org.kde.taskmanager as TaskManager
 import homm3map 1.0
 
 WallpaperItem {
@@ -22,9 +25,69 @@ WallpaperItem {
 	readonly property int initial_position_x: root.configuration.InitialPositionX
 	readonly property int initial_position_y: root.configuration.InitialPositionY
 	readonly property double scale: root.configuration.Scale
+	readonly property bool animation_enabled: root.configuration.AnimationEnabled
+	readonly property int max_animation_rate: root.configuration.MaxAnimationRate
+	readonly property bool pause_when_obscured: root.configuration.PauseWhenObscured
+	readonly property bool pause_on_battery: root.configuration.PauseOnBattery
+	readonly property bool on_battery: pause_on_battery && (power_source.data["AC Adapter"] !== undefined) && (power_source.data["AC Adapter"]["Plugged in"] === false)
+	readonly property bool obscured: pause_when_obscured && (windows_cover_screen || screen_lock.locked)
+
+	property bool windows_cover_screen: false
 
 	readonly property int tile_size: 32
 
+	P5Support.DataSource {
+		id: power_source
+		engine: "powermanagement"
+		connectedSources: pause_on_battery ? ["AC Adapter"] : []
+	}
+
+	// wallpaper window stays exposed under other windows and lock screen, so check them here
+	ScreenLockWatcher {
+		id: screen_lock
+	}
+
+	TaskManager.VirtualDesktopInfo {
+		id: virtual_desktop_info
+	}
+
+	TaskManager.ActivityInfo {
+		id: activity_info
+	}
+
+	TaskManager.TasksModel {
+		id: tasks_model
+		groupMode: TaskManager.TasksModel.GroupDisabled
+
+		screenGeometry: Qt.rect(root.Screen.virtualX, root.Screen.virtualY, root.Screen.width, root.Screen.height)
+		virtualDesktop: virtual_desktop_info.currentDesktop
+		activity: activity_info.currentActivity
+
+		filterByScreen: true
+		filterByVirtualDesktop: true
+		filterByActivity: true
+		filterMinimized: true
+
+		onCountChanged: updateWindowsCoverScreen()
+		onDataChanged: updateWindowsCoverScreen()
+	}
+
+	function updateWindowsCoverScreen()
+	{
+		for (var i = 0; i < tasks_model.count; ++i)
+		{
+			var idx = tasks_model.index(i, 0);
+
+			if (tasks_model.data(idx, TaskManager.AbstractTasksModel.IsMaximized) || tasks_model.data(idx, TaskManager.AbstractTasksModel.IsFullScreen))
+			{
+				windows_cover_screen = true;
+				return;
+			}
+		}
+
+		windows_cover_screen = false;
+	}
+
 	Timer {
 		id: reloadTimer
 		interval: refresh_time * 1000
@@ -63,49 +126,55 @@ WallpaperItem {
 		anchors.fill: parent
 		fillMode: Image.Tile
 
+		// flickable keeps position on map, but map is only drawn in size of wallpaper
 		Flickable {
 			id: view
 			anchors.fill: parent
 			leftMargin: contentWidth >= width ? 0 : (width - contentWidth) / 2
 			topMargin: contentHeight >= height ? 0 : (height - contentHeight) / 2
-			contentItem.clip: true
 
 			interactive: false
 
-			contentWidth: map.width
-			contentHeight: map.height
-
-			Homm3Map {
-				id: map
+			contentWidth: map.contentWidth
+			contentHeight: map.contentHeight
+		}
 
-				scale: root.scale
+		Homm3Map {
+			id: map
+			anchors.fill: parent
 
-				onLoadingFinished: {
-					if (map.isMapLoaded())
+			scale: root.scale
+			cameraX: view.contentX
+			cameraY: view.contentY
+			animationEnabled: animation_enabled && !on_battery && !obscured
+			maxAnimationRate: max_animation_rate
+			pauseWhenObscured: pause_when_obscured
+
+			onLoadingFinished: {
+				if (map.isMapLoaded())
+				{
+					if (random_initial_posiion)
 					{
-						if (random_initial_posiion)
+						if (view.contentWidth > view.width)
 						{
-							if (view.contentWidth > view.width)
-							{
-								view.contentX = Math.round(Math.random() * (view.contentWidth - view.width) / (tile_size * root.scale)) * (tile_size * root.scale);
-							}
-
-							if (view.contentHeight > view.height)
-							{
-								view.contentY = Math.round(Math.random() * (view.contentHeight - view.height) / (tile_size * root.scale)) * (tile_size * root.scale);
-							}
+							view.contentX = Math.round(Math.random() * (view.contentWidth - view.width) / (tile_size * root.scale)) * (tile_size * root.scale);
 						}
-						else
+
+						if (view.contentHeight > view.height)
 						{
-							view.contentX = (initial_position_x + 1) * tile_size * root.scale;
-							view.contentY = (initial_position_y + 1) * tile_size * root.scale;
+							view.contentY = Math.round(Math.random() * (view.contentHeight - view.height) / (tile_size * root.scale)) * (tile_size * root.scale);
 						}
 					}
 					else
 					{
-						map.loadMap(chooseRandomMap(), chooseMapLevel());
+						view.contentX = (initial_position_x + 1) * tile_size * root.scale;
+						view.contentY = (initial_position_y + 1) * tile_size * root.scale;
 					}
 				}
+				else
+				{
+					map.loadMap(chooseRandomMap(), chooseMapLevel());
+				}
 			}
 		}
 	}
@@ -123,7 +192,7 @@ WallpaperItem {
 	}
 
 	onScaleChanged: {
-		// due to scale change, map needs to be reloaded. For now just load next map
+		// initial position depends on scale, so for now just load next map
 		map.loadMap(chooseRandomMap(), chooseMapLevel());
 	}
 }